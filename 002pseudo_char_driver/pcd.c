@@ -4,6 +4,8 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/overflow.h>
 
 #undef pr_fmt
 #define pr_fmt(fmt) "[%s:%d] "fmt, __func__, __LINE__
@@ -19,18 +21,16 @@ static dev_t pcd_dev_number;
 static struct cdev pcd_cdev;
 
 loff_t pcd_lseek(struct file *filp, loff_t off, int whence);
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count,
-		 loff_t *f_pos);
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count,
-		  loff_t *f_pos);
+ssize_t pcd_read(struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write(struct kiocb *iocb, struct iov_iter *from);
 int pcd_open(struct inode *inode, struct file *filp);
 int pcd_release(struct inode *inode, struct file *filp);
 
 /* file operations of the driver */
 static struct file_operations pcd_fops = {
 	.llseek = pcd_lseek,
-	.read = pcd_read,
-	.write = pcd_write,
+	.read_iter = pcd_read,
+	.write_iter = pcd_write,
 	.open = pcd_open,
 	.release = pcd_release,
 	.owner = THIS_MODULE
@@ -42,8 +42,8 @@ struct device * pcd_dev;
 loff_t pcd_lseek(struct file *filp, loff_t off, int whence)
 {
    loff_t temp;
-   pr_info("lseek requested\n");
-   pr_info("Current file position = %lld\n", filp->f_pos);
+   pr_debug("lseek requested\n");
+   pr_debug("Current file position = %lld\n", filp->f_pos);
 
    switch(whence)
    {
@@ -53,88 +53,105 @@ loff_t pcd_lseek(struct file *filp, loff_t off, int whence)
          filp->f_pos = off;
          break;
       case SEEK_CUR:
-         temp = filp->f_pos + off;
+         if (check_add_overflow(filp->f_pos, off, &temp))
+            return -EINVAL;
          if ((temp > DEV_MEM_SIZE) || (temp < 0))
             return -EINVAL;
          filp->f_pos = temp;
          break;
       case SEEK_END:
-         temp = DEV_MEM_SIZE + off;
+         if (check_add_overflow((loff_t)DEV_MEM_SIZE, off, &temp))
+            return -EINVAL;
          if ((temp > DEV_MEM_SIZE) || (temp < 0))
             return -EINVAL;
-         filp->f_pos = DEV_MEM_SIZE + off;
+         filp->f_pos = temp;
          break;
       default:
          return -EINVAL;
    }
 
-   pr_info("New value of file pointer = %lld\n", filp->f_pos);
+   pr_debug("New value of file pointer = %lld\n", filp->f_pos);
    return filp->f_pos;
 }
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count,
-      loff_t *f_pos)
+ssize_t pcd_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	pr_info("Read requested for %zu bytes\n", count);
-	pr_info("Current file position = %lld\n", *f_pos);
+	size_t count = iov_iter_count(to);
+	size_t copied;
+
+	pr_debug("Read requested for %zu bytes\n", count);
+	pr_debug("Current file position = %lld\n", iocb->ki_pos);
+
+	/* Nothing left to read at or beyond the end of the device */
+	if (iocb->ki_pos >= DEV_MEM_SIZE)
+		return 0;
 
 	/* Adjust the 'count' */
-	if ((*f_pos + count) > DEV_MEM_SIZE)
-		count = DEV_MEM_SIZE - *f_pos;
+	if ((iocb->ki_pos + count) > DEV_MEM_SIZE)
+		count = DEV_MEM_SIZE - iocb->ki_pos;
 
-	/* copy to user */
-	if (copy_to_user(buff, &device_buffer[*f_pos], count)) {
+	/* copy to user, possibly into several user buffers at once */
+	copied = copy_to_iter(&device_buffer[iocb->ki_pos], count, to);
+	if (count && !copied)
 		return -EFAULT;
-	}
 
 	/* update the current file position */
-	*f_pos += count;
-	pr_info("Number of bytes succesfully read = %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
+	iocb->ki_pos += copied;
+	pr_debug("Number of bytes succesfully read = %zu\n", copied);
+	pr_debug("Updated file position = %lld\n", iocb->ki_pos);
 
 	/* return the number of bytes which have been succesfully read */
-	return count;
+	return copied;
 }
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count,
-      loff_t *f_pos)
+ssize_t pcd_write(struct kiocb *iocb, struct iov_iter *from)
 {
-	pr_info("Write requested for %zu bytes \n", count);
-	pr_info("Current file position = %lld\n", *f_pos);
+	size_t count = iov_iter_count(from);
+	size_t copied;
+
+	pr_debug("Write requested for %zu bytes \n", count);
+	pr_debug("Current file position = %lld\n", iocb->ki_pos);
+
+	if (!count)
+		return 0;
 
 	/* Adjust the 'count' */
-	if ((*f_pos + count) > DEV_MEM_SIZE)
-		count = DEV_MEM_SIZE - *f_pos;
+	if (iocb->ki_pos >= DEV_MEM_SIZE)
+		count = 0;
+	else if ((iocb->ki_pos + count) > DEV_MEM_SIZE)
+		count = DEV_MEM_SIZE - iocb->ki_pos;
 
 	if(!count)
 	{
-		pr_err("No space left on the device!\n");
+		pr_debug("No space left on the device!\n");
 		return -ENOMEM;
 	}
 
-	/* copy from user */
-	if (copy_from_user(&device_buffer[*f_pos], buff, count)) {
+	/* copy from user, possibly from several user buffers at once */
+	copied = copy_from_iter(&device_buffer[iocb->ki_pos], count, from);
+	if (!copied)
 		return -EFAULT;
-	}
 
 	/* update the current file position */
-	*f_pos += count;
-	pr_info("Number of bytes written successfully = %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
+	iocb->ki_pos += copied;
+	pr_debug("Number of bytes written successfully = %zu\n", copied);
+	pr_debug("Updated file position = %lld\n", iocb->ki_pos);
 
 	/* return the number of bytes which have been succesfully writen */
-	return count;
+	return copied;
 }
 
 int pcd_open(struct inode *inode, struct file *filp)
 {
-	pr_info("Open was succesful\n");
+	/* read and write never sleep, so RWF_NOWAIT and io_uring may be used */
+	filp->f_mode |= FMODE_NOWAIT;
+	pr_debug("Open was succesful\n");
 	return 0;
 }
 
 int pcd_release(struct inode *inode, struct file *filp)
 {
-	pr_info("Release was successful\n");
+	pr_debug("Release was successful\n");
 	return 0;
 }
 
@@ -4,26 +4,39 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/seqlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/overflow.h>
 
 #undef pr_fmt
 #define pr_fmt(fmt) "[%s:%d] "fmt, __func__, __LINE__
 
-#define NO_OF_DEVICES ( 4 )
+#define NO_OF_DEVICES ( 5 )
 
 #define RDONLY ( 0x01 )
 #define WRONLY ( 0x10 )
 #define RDWR   ( 0x11 )
 
+/* Device modes */
+#define PCD_MODE_FLAT ( 0 ) /* fixed size buffer addressed by f_pos */
+#define PCD_MODE_FIFO ( 1 ) /* ring buffer with blocking reads and writes */
+
 #define MEM_SIZE_MAX_PCDEV1 ( 1024 )
 #define MEM_SIZE_MAX_PCDEV2 ( 1024 )
 #define MEM_SIZE_MAX_PCDEV3 ( 1024 )
 #define MEM_SIZE_MAX_PCDEV4 ( 1024 )
+#define MEM_SIZE_MAX_PCDEV5 ( 1024 )
 
 /* pseudo device's memory */
 static char device_buffer_pcdev1[MEM_SIZE_MAX_PCDEV1];
 static char device_buffer_pcdev2[MEM_SIZE_MAX_PCDEV2];
 static char device_buffer_pcdev3[MEM_SIZE_MAX_PCDEV3];
 static char device_buffer_pcdev4[MEM_SIZE_MAX_PCDEV4];
+static char device_buffer_pcdev5[MEM_SIZE_MAX_PCDEV5];
 
 /* Device private data structure */
 struct pcdev_private_data {
@@ -31,6 +44,17 @@ struct pcdev_private_data {
 	unsigned int size;
 	const char *serial_number;
 	int perm;
+	int mode;
+	/* lets readers run in parallel while keeping them consistent
+	 * with writers */
+	seqlock_t lock;
+	/* PCD_MODE_FIFO: data is read at 'tail' and written at 'head' */
+	unsigned int head;
+	unsigned int tail;
+	unsigned int used;
+	struct mutex fifo_lock;
+	wait_queue_head_t read_wq;
+	wait_queue_head_t write_wq;
 	struct cdev cdev;
 };
 
@@ -71,23 +95,30 @@ static struct pcdrv_private_data pcdrv_data = {
 			.serial_number = "PCDEV4XYZ123",
 			.perm = RDONLY, /* RDONLY */
 		},
+		[4] = {
+			.buffer = device_buffer_pcdev5,
+			.size = MEM_SIZE_MAX_PCDEV5,
+			.serial_number = "PCDEV5XYZ123",
+			.perm = RDWR, /* RDWR */
+			.mode = PCD_MODE_FIFO,
+		},
 	}
 };
 
 
 loff_t pcd_lseek(struct file *filp, loff_t off, int whence);
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count,
-		 loff_t *f_pos);
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count,
-		  loff_t *f_pos);
+ssize_t pcd_read(struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write(struct kiocb *iocb, struct iov_iter *from);
 int pcd_open(struct inode *inode, struct file *filp);
 int pcd_release(struct inode *inode, struct file *filp);
+__poll_t pcd_poll(struct file *filp, struct poll_table_struct *wait);
 
 /* file operations of the driver */
 static struct file_operations pcd_fops = {
 	.llseek = pcd_lseek,
-	.read = pcd_read,
-	.write = pcd_write,
+	.read_iter = pcd_read,
+	.write_iter = pcd_write,
+	.poll = pcd_poll,
 	.open = pcd_open,
 	.release = pcd_release,
 	.owner = THIS_MODULE
@@ -99,8 +130,12 @@ loff_t pcd_lseek(struct file *filp, loff_t off, int whence)
 	loff_t temp;
 	struct pcdev_private_data *priv = (struct pcdev_private_data *)filp->private_data;
 	int max_size = priv->size;
-	pr_info("lseek requested\n");
-	pr_info("Current file position = %lld\n", filp->f_pos);
+	pr_debug("lseek requested\n");
+	pr_debug("Current file position = %lld\n", filp->f_pos);
+
+	/* a stream has no position to seek to */
+	if (priv->mode == PCD_MODE_FIFO)
+		return -ESPIPE;
 
 	switch(whence)
 	{
@@ -110,83 +145,269 @@ loff_t pcd_lseek(struct file *filp, loff_t off, int whence)
 			filp->f_pos = off;
 			break;
 		case SEEK_CUR:
-			temp = filp->f_pos + off;
+			if (check_add_overflow(filp->f_pos, off, &temp))
+				return -EINVAL;
 			if ((temp > max_size) || (temp < 0))
 				return -EINVAL;
 			filp->f_pos = temp;
 			break;
 		case SEEK_END:
-			temp = max_size + off;
+			if (check_add_overflow((loff_t)max_size, off, &temp))
+				return -EINVAL;
 			if ((temp > max_size) || (temp < 0))
 				return -EINVAL;
-			filp->f_pos = max_size + off;
+			filp->f_pos = temp;
 			break;
 		default:
 			return -EINVAL;
 	}
 
-	pr_info("New value of file pointer = %lld\n", filp->f_pos);
+	pr_debug("New value of file pointer = %lld\n", filp->f_pos);
 	return filp->f_pos;
 }
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count,
-      loff_t *f_pos)
+static bool pcd_nonblock(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+	       (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static bool pcd_fifo_ready(struct pcdev_private_data *priv, bool write)
+{
+	unsigned int used = READ_ONCE(priv->used);
+
+	return write ? (used < priv->size) : (used > 0);
+}
+
+/*
+ * Takes fifo_lock once the FIFO can be read (or written), sleeping until then
+ * unless the caller asked for non-blocking I/O.
+ */
+static int pcd_fifo_lock(struct kiocb *iocb, struct pcdev_private_data *priv,
+			 bool write)
+{
+	wait_queue_head_t *wq = write ? &priv->write_wq : &priv->read_wq;
+
+	while (1) {
+		if (iocb->ki_flags & IOCB_NOWAIT) {
+			if (!mutex_trylock(&priv->fifo_lock))
+				return -EAGAIN;
+		} else {
+			mutex_lock(&priv->fifo_lock);
+		}
+
+		if (pcd_fifo_ready(priv, write))
+			return 0;
+		mutex_unlock(&priv->fifo_lock);
+
+		if (pcd_nonblock(iocb))
+			return -EAGAIN;
+		if (wait_event_interruptible(*wq, pcd_fifo_ready(priv, write)))
+			return -ERESTARTSYS;
+	}
+}
+
+static ssize_t pcd_fifo_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(to);
+	size_t copied = 0;
+	size_t chunk;
+	size_t n;
+	int ret;
+
+	if (!count)
+		return 0;
+
+	/* block until there is something to read */
+	ret = pcd_fifo_lock(iocb, priv, false);
+	if (ret)
+		return ret;
+
+	count = min_t(size_t, count, priv->used);
+	while (copied < count) {
+		/* the data may wrap around the end of the buffer */
+		chunk = min_t(size_t, count - copied, priv->size - priv->tail);
+		n = copy_to_iter(&priv->buffer[priv->tail], chunk, to);
+		copied += n;
+		priv->tail = (priv->tail + n) % priv->size;
+		if (n < chunk)
+			break;
+	}
+	WRITE_ONCE(priv->used, priv->used - copied);
+	mutex_unlock(&priv->fifo_lock);
+
+	if (!copied)
+		return -EFAULT;
+
+	/* there is room for writers now */
+	wake_up_interruptible(&priv->write_wq);
+	pr_debug("Number of bytes succesfully read = %zu\n", copied);
+
+	return copied;
+}
+
+static ssize_t pcd_fifo_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	size_t copied = 0;
+	size_t chunk;
+	size_t n;
+	int ret;
+
+	if (!count)
+		return 0;
+
+	/* block until there is room to write */
+	ret = pcd_fifo_lock(iocb, priv, true);
+	if (ret)
+		return ret;
+
+	count = min_t(size_t, count, priv->size - priv->used);
+	while (copied < count) {
+		chunk = min_t(size_t, count - copied, priv->size - priv->head);
+		n = copy_from_iter(&priv->buffer[priv->head], chunk, from);
+		copied += n;
+		priv->head = (priv->head + n) % priv->size;
+		if (n < chunk)
+			break;
+	}
+	WRITE_ONCE(priv->used, priv->used + copied);
+	mutex_unlock(&priv->fifo_lock);
+
+	if (!copied)
+		return -EFAULT;
+
+	/* there is data for readers now */
+	wake_up_interruptible(&priv->read_wq);
+	pr_debug("Number of bytes written successfully = %zu\n", copied);
+
+	return copied;
+}
+
+__poll_t pcd_poll(struct file *filp, struct poll_table_struct *wait)
 {
 	struct pcdev_private_data *priv = (struct pcdev_private_data *)filp->private_data;
+	__poll_t mask = 0;
+	unsigned int used;
+
+	/* a flat buffer can always be read and written */
+	if (priv->mode != PCD_MODE_FIFO)
+		return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(filp, &priv->read_wq, wait);
+	poll_wait(filp, &priv->write_wq, wait);
+
+	used = READ_ONCE(priv->used);
+	if (used)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (used < priv->size)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+ssize_t pcd_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)iocb->ki_filp->private_data;
 	int max_size = priv->size;
+	size_t count = iov_iter_count(to);
+	size_t copied;
+	unsigned int seq;
 
-	pr_info("Read requested for %zu bytes\n", count);
-	pr_info("Current file position = %lld\n", *f_pos);
+	if (priv->mode == PCD_MODE_FIFO)
+		return pcd_fifo_read(iocb, to);
+
+	pr_debug("Read requested for %zu bytes\n", count);
+	pr_debug("Current file position = %lld\n", iocb->ki_pos);
+
+	/* Nothing left to read at or beyond the end of the device */
+	if (iocb->ki_pos >= max_size)
+		return 0;
 
 	/* Adjust the 'count' */
-	if ((*f_pos + count) > max_size)
-		count = max_size - *f_pos;
+	if ((iocb->ki_pos + count) > max_size)
+		count = max_size - iocb->ki_pos;
+
+	/* copy to user, possibly into several user buffers at once. Readers
+	 * never block each other: if a writer changed the buffer while we were
+	 * copying, the copy is simply done again. */
+	do {
+		seq = read_seqbegin(&priv->lock);
+		copied = copy_to_iter(&priv->buffer[iocb->ki_pos], count, to);
+		if (!read_seqretry(&priv->lock, seq))
+			break;
+		iov_iter_revert(to, copied);
+	} while (1);
 
-	/* copy to user */
-	if (copy_to_user(buff, &priv->buffer[*f_pos], count)) {
+	if (count && !copied)
 		return -EFAULT;
-	}
 
 	/* update the current file position */
-	*f_pos += count;
-	pr_info("Number of bytes succesfully read = %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
+	iocb->ki_pos += copied;
+	pr_debug("Number of bytes succesfully read = %zu\n", copied);
+	pr_debug("Updated file position = %lld\n", iocb->ki_pos);
 
 	/* return the number of bytes which have been succesfully read */
-	return count;
+	return copied;
 }
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count,
-      loff_t *f_pos)
+ssize_t pcd_write(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct pcdev_private_data *priv = (struct pcdev_private_data *)filp->private_data;
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)iocb->ki_filp->private_data;
 	int max_size = priv->size;
+	size_t count = iov_iter_count(from);
+	size_t copied;
+	char *kbuf;
+
+	if (priv->mode == PCD_MODE_FIFO)
+		return pcd_fifo_write(iocb, from);
+
+	pr_debug("Write requested for %zu bytes \n", count);
+	pr_debug("Current file position = %lld\n", iocb->ki_pos);
 
-	pr_info("Write requested for %zu bytes \n", count);
-	pr_info("Current file position = %lld\n", *f_pos);
+	if (!count)
+		return 0;
 
 	/* Adjust the 'count' */
-	if (((*f_pos) + count) > max_size)
-		count = max_size - (*f_pos);
+	if (iocb->ki_pos >= max_size)
+		count = 0;
+	else if ((iocb->ki_pos + count) > max_size)
+		count = max_size - iocb->ki_pos;
 
 	if(!count)
 	{
-		pr_err("No space left on the device!\n");
+		pr_debug("No space left on the device!\n");
 		return -ENOMEM;
 	}
 
-	/* copy from user */
-	if (copy_from_user(&priv->buffer[*f_pos], buff, count)) {
+	/* copy from user, possibly from several user buffers at once. The data
+	 * is staged first, since copying from user space may fault and sleep,
+	 * so that the buffer is only held for a memcpy(). */
+	kbuf = kvmalloc(count, (iocb->ki_flags & IOCB_NOWAIT) ?
+			GFP_NOWAIT : GFP_KERNEL);
+	if (!kbuf)
+		return (iocb->ki_flags & IOCB_NOWAIT) ? -EAGAIN : -ENOMEM;
+
+	copied = copy_from_iter(kbuf, count, from);
+	if (!copied) {
+		kvfree(kbuf);
 		return -EFAULT;
 	}
 
+	write_seqlock(&priv->lock);
+	memcpy(&priv->buffer[iocb->ki_pos], kbuf, copied);
+	write_sequnlock(&priv->lock);
+	kvfree(kbuf);
+
 	/* update the current file position */
-	*f_pos += count;
-	pr_info("Number of bytes written successfully = %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
+	iocb->ki_pos += copied;
+	pr_debug("Number of bytes written successfully = %zu\n", copied);
+	pr_debug("Updated file position = %lld\n", iocb->ki_pos);
 
 	/* return the number of bytes which have been succesfully writen */
-	return count;
+	return copied;
 }
 
 
@@ -212,26 +433,33 @@ int pcd_open(struct inode *inode, struct file *filp)
 
 	/* find out on which device file open was attempted by the user space */
 	minor_n = MINOR(inode->i_rdev);
-	pr_info("minor access = %d\n", minor_n);
+	pr_debug("minor access = %d\n", minor_n);
 
 	/* get device's private data structure */
 	priv = container_of(inode->i_cdev, struct pcdev_private_data, cdev);
 	/* supply device private data to other methods of the driver */
 	filp->private_data = priv;
+	/* read and write honour IOCB_NOWAIT, so RWF_NOWAIT and io_uring may be
+	 * used. Threads sharing this file serialize their updates of f_pos. */
+	filp->f_mode |= FMODE_NOWAIT | FMODE_ATOMIC_POS;
+
+	/* a FIFO has no file position: no lseek, pread or pwrite */
+	if (priv->mode == PCD_MODE_FIFO)
+		stream_open(inode, filp);
 
 	/* check permission */
 	ret = check_permission(priv->perm, filp->f_mode);
 	if(ret)
-		pr_info("Open unsuccesful\n");
+		pr_debug("Open unsuccesful\n");
 	else
-		pr_info("Open was succesful\n");
+		pr_debug("Open was succesful\n");
 
 	return ret;
 }
 
 int pcd_release(struct inode *inode, struct file *filp)
 {
-	pr_info("Release was successful\n");
+	pr_debug("Release was successful\n");
 	return 0;
 }
 
@@ -266,6 +494,11 @@ static int __init pcd_driver_init(void)
 			MAJOR(p->pcd_dev_number + i),
 			MINOR(p->pcd_dev_number + i));
 
+		seqlock_init(&p->pcdev_data[i].lock);
+		mutex_init(&p->pcdev_data[i].fifo_lock);
+		init_waitqueue_head(&p->pcdev_data[i].read_wq);
+		init_waitqueue_head(&p->pcdev_data[i].write_wq);
+
 		/* 3. Initialize the cdev struct with fops */
 		cdev_init(&p->pcdev_data[i].cdev, &pcd_fops);
 
@@ -0,0 +1,593 @@
+/*
+ * pcd_bench - user space benchmark of the pcd character devices
+ *
+ * Drives a /dev/pcdev-* node created by pcd_n.c or pcd_platform_driver.c
+ * and prints one JSON document with the throughput and the p50/p99/p999
+ * latency of every test run.
+ *
+ * Usage: pcd_bench [-d device] [-t tests] [-b block sizes] [-j threads]
+ *                  [-n ops per thread] [-c cpus]
+ *
+ *   -d  device node (default /dev/pcdev-1)
+ *   -t  comma separated tests (default all of them):
+ *       seqread, seqwrite, randread, randwrite, lseek, openclose,
+ *       contention, sg
+ *   -b  comma separated block sizes in bytes (default 64,512,4096)
+ *   -j  comma separated thread counts, each one is a separate run
+ *       (default 1)
+ *   -n  operations per thread (default 10000)
+ *   -c  comma separated CPUs, thread i is pinned to the i-th one modulo
+ *       their number (default no pinning)
+ *
+ * 'contention' runs one writer next to j - 1 readers and reports both
+ * sides, so that reader scaling can be read off several -j values.
+ * Tests the device cannot run (writes to a read-only device, seeks on
+ * a stream, the scatter-gather ioctl on pcd_n.c) are skipped. Streams are
+ * opened O_NONBLOCK so that an empty or full one cannot hang a run; the
+ * EAGAIN failures then show up in "errors".
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "pcd_ioctl.h"
+
+#define MAX_LIST 64
+
+/* Descriptors handed to one PCD_IOC_SG call of the 'sg' test */
+#define SG_BATCH 16
+
+enum bench_test {
+	TEST_SEQREAD = 0,
+	TEST_SEQWRITE,
+	TEST_RANDREAD,
+	TEST_RANDWRITE,
+	TEST_LSEEK,
+	TEST_OPENCLOSE,
+	TEST_CONTENTION,
+	TEST_SG,
+	TEST_MAX
+};
+
+static const char * const test_names[TEST_MAX] = {
+	[TEST_SEQREAD] = "seqread",
+	[TEST_SEQWRITE] = "seqwrite",
+	[TEST_RANDREAD] = "randread",
+	[TEST_RANDWRITE] = "randwrite",
+	[TEST_LSEEK] = "lseek",
+	[TEST_OPENCLOSE] = "openclose",
+	[TEST_CONTENTION] = "contention",
+	[TEST_SG] = "sg",
+};
+
+struct bench_opts {
+	const char *dev;
+	int tests[TEST_MAX];
+	long bs[MAX_LIST];
+	int nr_bs;
+	long threads[MAX_LIST];
+	int nr_threads;
+	long cpus[MAX_LIST];
+	int nr_cpus;
+	long ops;
+};
+
+/* What the device turned out to support */
+struct bench_dev {
+	int readable;
+	int writable;
+	/* -1 if the device is a stream */
+	off_t size;
+	/* PCD_IOC_SG is known */
+	int sg;
+};
+
+/* State of one benchmark thread */
+struct bench_job {
+	const struct bench_opts *opts;
+	const struct bench_dev *bdev;
+	enum bench_test test;
+	long bs;
+	int writer;
+	int cpu;
+	unsigned int seed;
+	pthread_barrier_t *barrier;
+	/* results */
+	uint64_t *lat;
+	long done;
+	long errors;
+	long long bytes;
+	struct timespec start;
+	struct timespec end;
+};
+
+static uint64_t ts_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_ns(&ts);
+}
+
+/* Parses "a,b,c" into 'list', returns the number of entries or -1 */
+static int parse_list(const char *arg, long *list)
+{
+	char *copy = strdup(arg);
+	char *save = NULL;
+	char *tok;
+	char *end;
+	int n = 0;
+
+	if (!copy)
+		return -1;
+
+	for (tok = strtok_r(copy, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (n == MAX_LIST)
+			goto err;
+		list[n] = strtol(tok, &end, 0);
+		if (*end || list[n] < 0)
+			goto err;
+		n++;
+	}
+
+	free(copy);
+	return n;
+
+err:
+	free(copy);
+	return -1;
+}
+
+static int parse_tests(const char *arg, int *tests)
+{
+	char *copy = strdup(arg);
+	char *save = NULL;
+	char *tok;
+	int i;
+
+	if (!copy)
+		return -1;
+
+	memset(tests, 0, TEST_MAX * sizeof(*tests));
+	for (tok = strtok_r(copy, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < TEST_MAX; i++)
+			if (!strcmp(tok, test_names[i]))
+				break;
+		if (i == TEST_MAX) {
+			fprintf(stderr, "unknown test '%s'\n", tok);
+			free(copy);
+			return -1;
+		}
+		tests[i] = 1;
+	}
+
+	free(copy);
+	return 0;
+}
+
+/* Finds out how the device can be used, returns -1 if it cannot at all */
+static int probe_dev(const char *dev, struct bench_dev *bdev)
+{
+	struct pcd_sg_batch batch;
+	int fd;
+
+	fd = open(dev, O_RDWR);
+	if (fd >= 0) {
+		bdev->readable = bdev->writable = 1;
+	} else {
+		fd = open(dev, O_RDONLY);
+		if (fd >= 0) {
+			bdev->readable = 1;
+		} else {
+			fd = open(dev, O_WRONLY);
+			if (fd < 0)
+				return -1;
+			bdev->writable = 1;
+		}
+	}
+
+	bdev->size = lseek(fd, 0, SEEK_END);
+
+	/* an empty batch does nothing, but tells whether the ioctl exists */
+	memset(&batch, 0, sizeof(batch));
+	bdev->sg = ioctl(fd, PCD_IOC_SG, &batch) == 0;
+
+	close(fd);
+	return 0;
+}
+
+static int open_flags(const struct bench_dev *bdev)
+{
+	int flags = bdev->size < 0 ? O_NONBLOCK : 0;
+
+	if (bdev->readable && bdev->writable)
+		return flags | O_RDWR;
+	return flags | (bdev->readable ? O_RDONLY : O_WRONLY);
+}
+
+/* Random block aligned offset that leaves room for a whole block */
+static off_t rand_off(struct bench_job *job)
+{
+	off_t blocks = job->bdev->size / job->bs;
+
+	if (blocks <= 1)
+		return 0;
+	return (off_t)(rand_r(&job->seed) % blocks) * job->bs;
+}
+
+/*
+ * Sequential transfer of one block. Running into the end of the device
+ * rewinds to its start and is not counted as an operation.
+ */
+static ssize_t seq_io(struct bench_job *job, int fd, char *buf, int write_op)
+{
+	ssize_t ret;
+
+	ret = write_op ? write(fd, buf, job->bs) : read(fd, buf, job->bs);
+	if ((ret == 0 || (ret < 0 && errno == ENOMEM)) &&
+	    job->bdev->size > 0) {
+		lseek(fd, 0, SEEK_SET);
+		ret = write_op ? write(fd, buf, job->bs) :
+				 read(fd, buf, job->bs);
+	}
+
+	return ret;
+}
+
+/* Runs one operation of the job, returns the bytes moved or -1 */
+static ssize_t run_op(struct bench_job *job, int fd, char *buf,
+		      struct pcd_sg_desc *descs)
+{
+	struct pcd_sg_batch batch;
+	ssize_t ret;
+	int i;
+
+	switch (job->test) {
+	case TEST_SEQREAD:
+		return seq_io(job, fd, buf, 0);
+	case TEST_SEQWRITE:
+		return seq_io(job, fd, buf, 1);
+	case TEST_RANDREAD:
+		return pread(fd, buf, job->bs, rand_off(job));
+	case TEST_RANDWRITE:
+		return pwrite(fd, buf, job->bs, rand_off(job));
+	case TEST_LSEEK:
+		/* jump around, check where we are, then read a block */
+		if (lseek(fd, rand_off(job), SEEK_SET) < 0 ||
+		    lseek(fd, 0, SEEK_CUR) < 0)
+			return -1;
+		return read(fd, buf, job->bs);
+	case TEST_OPENCLOSE:
+		ret = open(job->opts->dev, open_flags(job->bdev));
+		if (ret < 0)
+			return -1;
+		close(ret);
+		return 0;
+	case TEST_CONTENTION:
+		return seq_io(job, fd, buf, job->writer);
+	case TEST_SG:
+		for (i = 0; i < SG_BATCH; i++) {
+			descs[i].offset = rand_off(job);
+			descs[i].addr = (uintptr_t)(buf + i * job->bs);
+			descs[i].len = job->bs;
+			descs[i].dir = PCD_SG_READ;
+			descs[i].result = 0;
+		}
+		batch.descs = (uintptr_t)descs;
+		batch.count = SG_BATCH;
+		batch.flags = 0;
+		if (ioctl(fd, PCD_IOC_SG, &batch) < 0)
+			return -1;
+		for (ret = 0, i = 0; i < SG_BATCH; i++) {
+			if (descs[i].result < 0)
+				return -1;
+			ret += descs[i].result;
+		}
+		return ret;
+	default:
+		return -1;
+	}
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_job *job = arg;
+	struct pcd_sg_desc descs[SG_BATCH];
+	cpu_set_t set;
+	uint64_t t0;
+	ssize_t ret;
+	char *buf;
+	long i;
+	int fd;
+
+	if (job->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(job->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "cannot pin to CPU %d\n", job->cpu);
+	}
+
+	buf = calloc(SG_BATCH, job->bs);
+	fd = open(job->opts->dev, open_flags(job->bdev));
+
+	pthread_barrier_wait(job->barrier);
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+	for (i = 0; buf && fd >= 0 && i < job->opts->ops; i++) {
+		t0 = now_ns();
+		ret = run_op(job, fd, buf, descs);
+		job->lat[job->done] = now_ns() - t0;
+		job->done++;
+		if (ret < 0)
+			job->errors++;
+		else
+			job->bytes += ret;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &job->end);
+
+	if (fd >= 0)
+		close(fd);
+	else
+		job->errors = job->opts->ops;
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *lat, long n, double p)
+{
+	long i;
+
+	if (!n)
+		return 0;
+	i = (long)(p * n);
+	return lat[i < n ? i : n - 1];
+}
+
+/* Merges the results of the jobs whose 'writer' is 'writer' and prints them */
+static void report(const struct bench_job *jobs, int nr_jobs, int writer,
+		   const char *name, int *first)
+{
+	uint64_t start = UINT64_MAX;
+	uint64_t end = 0;
+	long long bytes = 0;
+	long errors = 0;
+	uint64_t *lat;
+	double secs;
+	long n = 0;
+	int threads = 0;
+	int i;
+
+	for (i = 0; i < nr_jobs; i++)
+		if (jobs[i].writer == writer)
+			n += jobs[i].done;
+
+	lat = malloc((n ? n : 1) * sizeof(*lat));
+	if (!lat)
+		return;
+
+	for (n = 0, i = 0; i < nr_jobs; i++) {
+		if (jobs[i].writer != writer)
+			continue;
+		memcpy(lat + n, jobs[i].lat, jobs[i].done * sizeof(*lat));
+		n += jobs[i].done;
+		bytes += jobs[i].bytes;
+		errors += jobs[i].errors;
+		if (ts_ns(&jobs[i].start) < start)
+			start = ts_ns(&jobs[i].start);
+		if (ts_ns(&jobs[i].end) > end)
+			end = ts_ns(&jobs[i].end);
+		threads++;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	secs = end > start ? (end - start) / 1e9 : 0;
+
+	printf("%s\n    {\"test\": \"%s\", \"bs\": %ld, \"threads\": %d, "
+	       "\"ops\": %ld, \"errors\": %ld, \"bytes\": %lld, "
+	       "\"seconds\": %.6f, \"mb_per_s\": %.3f, \"ops_per_s\": %.1f, "
+	       "\"lat_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu}}",
+	       *first ? "" : ",", name, jobs[0].bs, threads, n, errors, bytes,
+	       secs, secs ? bytes / secs / 1e6 : 0, secs ? n / secs : 0,
+	       (unsigned long long)percentile(lat, n, 0.50),
+	       (unsigned long long)percentile(lat, n, 0.99),
+	       (unsigned long long)percentile(lat, n, 0.999));
+	*first = 0;
+
+	free(lat);
+}
+
+/* Tells whether 'test' makes sense on the device */
+static int test_supported(enum bench_test test, const struct bench_dev *bdev,
+			  long threads)
+{
+	switch (test) {
+	case TEST_SEQREAD:
+		return bdev->readable;
+	case TEST_SEQWRITE:
+		return bdev->writable;
+	case TEST_RANDREAD:
+	case TEST_LSEEK:
+		return bdev->readable && bdev->size > 0;
+	case TEST_SG:
+		return bdev->readable && bdev->size > 0 && bdev->sg;
+	case TEST_RANDWRITE:
+		return bdev->writable && bdev->size > 0;
+	case TEST_CONTENTION:
+		return bdev->readable && bdev->writable && threads > 1;
+	default:
+		return 1;
+	}
+}
+
+static int run_test(const struct bench_opts *opts,
+		    const struct bench_dev *bdev, enum bench_test test,
+		    long bs, long threads, int *first)
+{
+	pthread_barrier_t barrier;
+	struct bench_job *jobs;
+	pthread_t *tids;
+	int ret = 0;
+	long i;
+
+	jobs = calloc(threads, sizeof(*jobs));
+	tids = calloc(threads, sizeof(*tids));
+	if (!jobs || !tids) {
+		ret = -1;
+		goto out;
+	}
+	pthread_barrier_init(&barrier, NULL, threads);
+
+	for (i = 0; i < threads; i++) {
+		jobs[i].opts = opts;
+		jobs[i].bdev = bdev;
+		jobs[i].test = test;
+		jobs[i].bs = bs;
+		jobs[i].writer = test == TEST_CONTENTION && i == 0;
+		jobs[i].cpu = opts->nr_cpus ? opts->cpus[i % opts->nr_cpus] : -1;
+		jobs[i].seed = i + 1;
+		jobs[i].barrier = &barrier;
+		jobs[i].lat = malloc(opts->ops * sizeof(*jobs[i].lat));
+		if (!jobs[i].lat) {
+			ret = -1;
+			goto free_jobs;
+		}
+	}
+
+	for (i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, bench_thread, &jobs[i]);
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	if (test == TEST_CONTENTION) {
+		report(jobs, threads, 0, "contention-read", first);
+		report(jobs, threads, 1, "contention-write", first);
+	} else {
+		report(jobs, threads, 0, test_names[test], first);
+	}
+
+free_jobs:
+	for (i = 0; i < threads; i++)
+		free(jobs[i].lat);
+	pthread_barrier_destroy(&barrier);
+out:
+	free(tids);
+	free(jobs);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-t tests] [-b block sizes] "
+		"[-j threads] [-n ops] [-c cpus]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_opts opts = {
+		.dev = "/dev/pcdev-1",
+		.bs = {64, 512, 4096},
+		.nr_bs = 3,
+		.threads = {1},
+		.nr_threads = 1,
+		.ops = 10000,
+	};
+	struct bench_dev bdev = {0};
+	int first = 1;
+	int opt;
+	int t, b, j;
+
+	for (t = 0; t < TEST_MAX; t++)
+		opts.tests[t] = 1;
+
+	while ((opt = getopt(argc, argv, "d:t:b:j:n:c:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			opts.dev = optarg;
+			break;
+		case 't':
+			if (parse_tests(optarg, opts.tests))
+				return 1;
+			break;
+		case 'b':
+			opts.nr_bs = parse_list(optarg, opts.bs);
+			break;
+		case 'j':
+			opts.nr_threads = parse_list(optarg, opts.threads);
+			break;
+		case 'n':
+			opts.ops = strtol(optarg, NULL, 0);
+			break;
+		case 'c':
+			opts.nr_cpus = parse_list(optarg, opts.cpus);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (opts.nr_bs <= 0 || opts.nr_threads <= 0 || opts.nr_cpus < 0 ||
+	    opts.ops <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	for (b = 0; b < opts.nr_bs; b++)
+		if (opts.bs[b] == 0)
+			opts.bs[b] = 1;
+	for (j = 0; j < opts.nr_threads; j++)
+		if (opts.threads[j] == 0)
+			opts.threads[j] = 1;
+
+	if (probe_dev(opts.dev, &bdev)) {
+		fprintf(stderr, "cannot open %s: %s\n", opts.dev,
+			strerror(errno));
+		return 1;
+	}
+
+	printf("{\"device\": \"%s\", \"size\": %lld, \"ops_per_thread\": %ld, "
+	       "\"results\": [", opts.dev, (long long)bdev.size, opts.ops);
+
+	for (t = 0; t < TEST_MAX; t++) {
+		if (!opts.tests[t])
+			continue;
+		for (j = 0; j < opts.nr_threads; j++) {
+			if (!test_supported(t, &bdev, opts.threads[j]))
+				continue;
+			for (b = 0; b < opts.nr_bs; b++) {
+				if (run_test(&opts, &bdev, t, opts.bs[b],
+					     opts.threads[j], &first))
+					return 1;
+				/* the block size means nothing here */
+				if (t == TEST_OPENCLOSE)
+					break;
+			}
+		}
+	}
+
+	printf("\n]}\n");
+	return 0;
+}
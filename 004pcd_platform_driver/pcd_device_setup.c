@@ -1,5 +1,14 @@
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/configfs.h>
+#include <linux/idr.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/nodemask.h>
+#include <linux/string.h>
+#include <linux/device.h>
 
 #include "platform.h"
 
@@ -13,6 +22,8 @@ struct pcdev_platform_data  pcdev_pdata[] = {
 	[1] = {.size = 1024,.perm = RDWR, .serial_number = "PCDEVXYZ2222"},
 	[2] = {.size = 1024,.perm = RDONLY, .serial_number = "PCDEVXYZ3333"},
 	[3] = {.size = 1024,.perm = WRONLY, .serial_number = "PCDEVXYZ4444"},
+	[4] = {.size = 4096,.perm = RDWR, .serial_number = "PCDEVXYZ5555",
+	       .mode = PCD_MODE_SPSC},
 };
 
 struct platform_device platform_pcdev_1 = {
@@ -51,34 +62,564 @@ struct platform_device platform_pcdev_4 = {
 	},
 };
 
+struct platform_device platform_pcdev_5 = {
+	.name = "pcdev-E1x",
+	.id = 4,
+	.dev = {
+		.platform_data = &pcdev_pdata[4],
+		.release = pcdev_release,
+	},
+};
+
 struct platform_device * platform_pcdevs[] = {
 	&platform_pcdev_1,
 	&platform_pcdev_2,
 	&platform_pcdev_3,
-	&platform_pcdev_4
+	&platform_pcdev_4,
+	&platform_pcdev_5
 };
 
+/*
+ * Number of extra devices to register, to measure the cost of registering,
+ * probing and removing many devices at once (e.g. 10, 1000, 10000).
+ */
+static unsigned int nr_bench_devices;
+module_param(nr_bench_devices, uint, 0444);
+MODULE_PARM_DESC(nr_bench_devices, "Extra devices to register for timing");
+
+static struct pcdev_platform_data bench_pdata = {
+	.size = 1024, .perm = RDWR, .serial_number = "PCDEVBENCH"
+};
+static struct platform_device **bench_pcdevs;
+
 void pcdev_release(struct device *dev)
 {
-	pr_info("Device released!");
+	pr_debug("Device released!");
 	return;
 }
 
+static void bench_devices_unregister(unsigned int count)
+{
+	ktime_t start = ktime_get();
+
+	while (count--)
+		platform_device_unregister(bench_pcdevs[count]);
+
+	pr_info("Removed bench devices in %lld us",
+		ktime_us_delta(ktime_get(), start));
+	kfree(bench_pcdevs);
+}
+
+static int bench_devices_register(void)
+{
+	struct platform_device *pdev;
+	unsigned int i;
+	ktime_t start;
+
+	bench_pcdevs = kcalloc(nr_bench_devices, sizeof(*bench_pcdevs),
+			       GFP_KERNEL);
+	if (!bench_pcdevs)
+		return -ENOMEM;
+
+	start = ktime_get();
+	for (i = 0; i < nr_bench_devices; i++) {
+		/* ids follow the ones of the static devices */
+		pdev = platform_device_register_data(NULL, "pcdev-A1x",
+				ARRAY_SIZE(platform_pcdevs) + i,
+				&bench_pdata, sizeof(bench_pdata));
+		if (IS_ERR(pdev)) {
+			bench_devices_unregister(i);
+			return PTR_ERR(pdev);
+		}
+		bench_pcdevs[i] = pdev;
+	}
+
+	/* the driver probes asynchronously: count the probes in, so that
+	 * the time still covers registering and probing every device */
+	wait_for_device_probe();
+
+	pr_info("Registered and probed %u bench devices in %lld us",
+		nr_bench_devices, ktime_us_delta(ktime_get(), start));
+	return 0;
+}
+
+/*
+ * Runtime provisioning through configfs:
+ *
+ *	mkdir /sys/kernel/config/pcdev/<name>
+ *	echo 1048576 > /sys/kernel/config/pcdev/<name>/size
+ *	echo 0x11 > /sys/kernel/config/pcdev/<name>/perm
+ *	echo /var/lib/pcd/<name> > /sys/kernel/config/pcdev/<name>/backing_file
+ *	echo 1 > /sys/kernel/config/pcdev/<name>/reclaim
+ *	echo 1 > /sys/kernel/config/pcdev/commit
+ *
+ * Devices are created, and re-created after their attributes changed, in
+ * bulk by writing to 'commit'. A re-created device starts over from its
+ * backing file, so only a device with a backing file can be changed while
+ * it is live. Any change to a live device without one would silently wipe
+ * it, so commit refuses it with EBUSY: rmdir and mkdir the device to start
+ * over on purpose. Commit checks every change before it applies any.
+ *
+ * rmdir destroys a device right away: it can not be opened any more, but
+ * files, mappings and exports that are still open keep working on its
+ * contents until they are closed.
+ */
+
+#define PCDEV_SERIAL_LEN 32
+#define PCDEV_PATH_LEN 256
+
+struct pcdev_item {
+	struct config_item item;
+	/* configuration applied by the next commit */
+	struct pcdev_platform_data pdata;
+	char serial[PCDEV_SERIAL_LEN];
+	/* empty for a device without a backing file */
+	char backing_file[PCDEV_PATH_LEN];
+	bool dirty;
+	/* platform device id and live device, if committed */
+	int id;
+	struct platform_device *pdev;
+	char *live_serial;
+	char *live_backing_file;
+	struct list_head node;
+};
+
+/* Protects pcdev_items and the state of each item */
+static DEFINE_MUTEX(pcdev_items_lock);
+static LIST_HEAD(pcdev_items);
+static DEFINE_IDA(pcdev_id_ida);
+
+static inline struct pcdev_item *to_pcdev_item(struct config_item *item)
+{
+	return container_of(item, struct pcdev_item, item);
+}
+
+static void pcdev_item_unregister(struct pcdev_item *pi)
+{
+	if (!pi->pdev)
+		return;
+
+	platform_device_unregister(pi->pdev);
+	pi->pdev = NULL;
+	kfree(pi->live_serial);
+	pi->live_serial = NULL;
+	kfree(pi->live_backing_file);
+	pi->live_backing_file = NULL;
+}
+
+/* Whether the attributes of the item make a device it can register */
+static int pcdev_item_check(struct pcdev_item *pi)
+{
+	/* a preferred placement needs a node to prefer */
+	if (pi->pdata.numa_policy == PCD_NUMA_PREFERRED &&
+	    pi->pdata.numa_node == NUMA_NO_NODE)
+		return -EINVAL;
+
+	/* only pages that can be read back may be reclaimed as clean */
+	if (pi->pdata.reclaim == PCD_RECLAIM_CLEAN && !pi->backing_file[0])
+		return -EINVAL;
+
+	/* re-creating a live device without a backing file wipes it */
+	if (pi->pdev && !pi->live_backing_file)
+		return -EBUSY;
+
+	return 0;
+}
+
+static int pcdev_item_register(struct pcdev_item *pi)
+{
+	struct pcdev_platform_data pdata = pi->pdata;
+	struct platform_device *pdev;
+	int ret;
+
+	pi->live_serial = kstrdup(pi->serial, GFP_KERNEL);
+	if (!pi->live_serial)
+		return -ENOMEM;
+	pdata.serial_number = pi->live_serial;
+
+	if (pi->backing_file[0]) {
+		pi->live_backing_file = kstrdup(pi->backing_file, GFP_KERNEL);
+		if (!pi->live_backing_file) {
+			ret = -ENOMEM;
+			goto free_serial;
+		}
+	}
+	pdata.backing_file = pi->live_backing_file;
+
+	/* configfs devices are driven like the A1x model */
+	pdev = platform_device_alloc("pcdev-A1x", pi->id);
+	if (!pdev) {
+		ret = -ENOMEM;
+		goto free_serial;
+	}
+	set_dev_node(&pdev->dev, pdata.numa_node);
+
+	ret = platform_device_add_data(pdev, &pdata, sizeof(pdata));
+	if (ret)
+		goto put_pdev;
+
+	ret = platform_device_add(pdev);
+	if (ret)
+		goto put_pdev;
+
+	pi->pdev = pdev;
+	return 0;
+
+put_pdev:
+	platform_device_put(pdev);
+free_serial:
+	kfree(pi->live_serial);
+	pi->live_serial = NULL;
+	kfree(pi->live_backing_file);
+	pi->live_backing_file = NULL;
+	return ret;
+}
+
+#define PCDEV_ITEM_INT_ATTR(_name, _field, _fmt, _check)		\
+static ssize_t pcdev_item_##_name##_show(struct config_item *item,	\
+					 char *page)			\
+{									\
+	return sprintf(page, _fmt "\n", to_pcdev_item(item)->_field);	\
+}									\
+									\
+static ssize_t pcdev_item_##_name##_store(struct config_item *item,	\
+					  const char *page, size_t count)\
+{									\
+	struct pcdev_item *pi = to_pcdev_item(item);			\
+	long long val;							\
+	int ret;							\
+									\
+	ret = kstrtoll(page, 0, &val);					\
+	if (ret)							\
+		return ret;						\
+	if (!(_check))							\
+		return -EINVAL;						\
+									\
+	mutex_lock(&pcdev_items_lock);					\
+	pi->_field = val;						\
+	pi->dirty = true;						\
+	mutex_unlock(&pcdev_items_lock);				\
+	return count;							\
+}									\
+CONFIGFS_ATTR(pcdev_item_, _name)
+
+PCDEV_ITEM_INT_ATTR(size, pdata.size, "%lld", val > 0);
+PCDEV_ITEM_INT_ATTR(perm, pdata.perm, "0x%x",
+		    val == RDWR || val == RDONLY || val == WRONLY);
+PCDEV_ITEM_INT_ATTR(mode, pdata.mode, "%d",
+		    val == PCD_MODE_FLAT || val == PCD_MODE_SPSC ||
+		    val == PCD_MODE_SHARDED || val == PCD_MODE_RECORD);
+PCDEV_ITEM_INT_ATTR(numa_node, pdata.numa_node, "%d",
+		    val == NUMA_NO_NODE ||
+		    (val >= 0 && val < MAX_NUMNODES && node_online(val)));
+PCDEV_ITEM_INT_ATTR(numa_policy, pdata.numa_policy, "%d",
+		    val == PCD_NUMA_DEFAULT || val == PCD_NUMA_PREFERRED ||
+		    val == PCD_NUMA_INTERLEAVE);
+PCDEV_ITEM_INT_ATTR(reclaim, pdata.reclaim, "%d",
+		    val == PCD_RECLAIM_NONE || val == PCD_RECLAIM_CLEAN ||
+		    val == PCD_RECLAIM_DISCARD);
+
+static ssize_t pcdev_item_serial_number_show(struct config_item *item,
+					     char *page)
+{
+	return sprintf(page, "%s\n", to_pcdev_item(item)->serial);
+}
+
+static ssize_t pcdev_item_serial_number_store(struct config_item *item,
+					      const char *page, size_t count)
+{
+	struct pcdev_item *pi = to_pcdev_item(item);
+	char serial[PCDEV_SERIAL_LEN];
+
+	if (strscpy(serial, page, sizeof(serial)) < 0)
+		return -EINVAL;
+
+	mutex_lock(&pcdev_items_lock);
+	strcpy(pi->serial, strim(serial));
+	pi->dirty = true;
+	mutex_unlock(&pcdev_items_lock);
+	return count;
+}
+CONFIGFS_ATTR(pcdev_item_, serial_number);
+
+static ssize_t pcdev_item_backing_file_show(struct config_item *item,
+					    char *page)
+{
+	return sprintf(page, "%s\n", to_pcdev_item(item)->backing_file);
+}
+
+/* An empty path, or just a newline, detaches the backing file */
+static ssize_t pcdev_item_backing_file_store(struct config_item *item,
+					     const char *page, size_t count)
+{
+	struct pcdev_item *pi = to_pcdev_item(item);
+	char path[PCDEV_PATH_LEN];
+
+	if (strscpy(path, page, sizeof(path)) < 0)
+		return -EINVAL;
+
+	mutex_lock(&pcdev_items_lock);
+	strcpy(pi->backing_file, strim(path));
+	pi->dirty = true;
+	mutex_unlock(&pcdev_items_lock);
+	return count;
+}
+CONFIGFS_ATTR(pcdev_item_, backing_file);
+
+/* 1 once the device is bound to the driver and matches its attributes */
+static ssize_t pcdev_item_live_show(struct config_item *item, char *page)
+{
+	struct pcdev_item *pi = to_pcdev_item(item);
+	int live;
+
+	mutex_lock(&pcdev_items_lock);
+	live = pi->pdev && !pi->dirty && READ_ONCE(pi->pdev->dev.driver);
+	mutex_unlock(&pcdev_items_lock);
+
+	return sprintf(page, "%d\n", live);
+}
+CONFIGFS_ATTR_RO(pcdev_item_, live);
+
+static struct configfs_attribute *pcdev_item_attrs[] = {
+	&pcdev_item_attr_size,
+	&pcdev_item_attr_perm,
+	&pcdev_item_attr_mode,
+	&pcdev_item_attr_numa_node,
+	&pcdev_item_attr_numa_policy,
+	&pcdev_item_attr_serial_number,
+	&pcdev_item_attr_backing_file,
+	&pcdev_item_attr_reclaim,
+	&pcdev_item_attr_live,
+	NULL
+};
+
+static void pcdev_item_release(struct config_item *item)
+{
+	struct pcdev_item *pi = to_pcdev_item(item);
+
+	ida_free(&pcdev_id_ida, pi->id);
+	kfree(pi);
+}
+
+static struct configfs_item_operations pcdev_item_ops = {
+	.release = pcdev_item_release,
+};
+
+static const struct config_item_type pcdev_item_type = {
+	.ct_item_ops = &pcdev_item_ops,
+	.ct_attrs = pcdev_item_attrs,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct config_item *pcdev_make_item(struct config_group *group,
+					   const char *name)
+{
+	struct pcdev_item *pi;
+	int id;
+
+	/* ids of the static and bench devices are never handed out */
+	id = ida_alloc_min(&pcdev_id_ida,
+			   ARRAY_SIZE(platform_pcdevs) + nr_bench_devices,
+			   GFP_KERNEL);
+	if (id < 0)
+		return ERR_PTR(id);
+
+	pi = kzalloc(sizeof(*pi), GFP_KERNEL);
+	if (!pi) {
+		ida_free(&pcdev_id_ida, id);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	pi->id = id;
+	pi->pdata.size = 1024;
+	pi->pdata.perm = RDWR;
+	pi->pdata.mode = PCD_MODE_FLAT;
+	pi->pdata.numa_node = NUMA_NO_NODE;
+	pi->pdata.numa_policy = PCD_NUMA_DEFAULT;
+	pi->pdata.reclaim = PCD_RECLAIM_NONE;
+	strscpy(pi->serial, name, sizeof(pi->serial));
+	pi->dirty = true;
+	config_item_init_type_name(&pi->item, name, &pcdev_item_type);
+
+	mutex_lock(&pcdev_items_lock);
+	list_add_tail(&pi->node, &pcdev_items);
+	mutex_unlock(&pcdev_items_lock);
+
+	return &pi->item;
+}
+
+static void pcdev_drop_item(struct config_group *group,
+			    struct config_item *item)
+{
+	struct pcdev_item *pi = to_pcdev_item(item);
+
+	mutex_lock(&pcdev_items_lock);
+	list_del(&pi->node);
+	pcdev_item_unregister(pi);
+	mutex_unlock(&pcdev_items_lock);
+
+	config_item_put(item);
+}
+
+/* Whether the driver took the device of the item */
+static bool pcdev_item_bound(struct pcdev_item *pi)
+{
+	bool bound;
+
+	device_lock(&pi->pdev->dev);
+	bound = !!pi->pdev->dev.driver;
+	device_unlock(&pi->pdev->dev);
+
+	return bound;
+}
+
+/*
+ * Creates, or re-creates, every device whose attributes changed. Devices
+ * are probed asynchronously, so the probes are waited for: a device the
+ * driver did not bind is removed again, and commit fails with ENODEV. The
+ * driver logs why it refused the device.
+ */
+static ssize_t pcdev_commit_store(struct config_item *item,
+				  const char *page, size_t count)
+{
+	struct pcdev_item *pi;
+	bool commit;
+	int ret;
+
+	ret = kstrtobool(page, &commit);
+	if (ret)
+		return ret;
+	if (!commit)
+		return count;
+
+	mutex_lock(&pcdev_items_lock);
+	/* a device is only torn down once its replacement can be created */
+	list_for_each_entry(pi, &pcdev_items, node) {
+		if (!pi->dirty)
+			continue;
+		ret = pcdev_item_check(pi);
+		if (ret) {
+			pr_err("Cannot change device %s: %d\n",
+			       config_item_name(&pi->item), ret);
+			mutex_unlock(&pcdev_items_lock);
+			return ret;
+		}
+	}
+
+	list_for_each_entry(pi, &pcdev_items, node) {
+		if (!pi->dirty)
+			continue;
+		pcdev_item_unregister(pi);
+		ret = pcdev_item_register(pi);
+		if (ret) {
+			pr_err("Cannot create device %s: %d\n",
+			       config_item_name(&pi->item), ret);
+			break;
+		}
+		pi->dirty = false;
+	}
+
+	/* without the driver no device is bound, and none was refused */
+	wait_for_device_probe();
+	if (!driver_find(PCD_DRIVER_NAME, &platform_bus_type))
+		goto unlock;
+
+	list_for_each_entry(pi, &pcdev_items, node) {
+		if (!pi->pdev || pcdev_item_bound(pi))
+			continue;
+		pr_err("Device %s was not bound to the driver\n",
+		       config_item_name(&pi->item));
+		pcdev_item_unregister(pi);
+		pi->dirty = true;
+		if (!ret)
+			ret = -ENODEV;
+	}
+unlock:
+	mutex_unlock(&pcdev_items_lock);
+
+	return ret ? ret : count;
+}
+CONFIGFS_ATTR_WO(pcdev_, commit);
+
+static struct configfs_attribute *pcdev_group_attrs[] = {
+	&pcdev_attr_commit,
+	NULL
+};
+
+static struct configfs_group_operations pcdev_group_ops = {
+	.make_item = pcdev_make_item,
+	.drop_item = pcdev_drop_item,
+};
+
+static const struct config_item_type pcdev_group_type = {
+	.ct_group_ops = &pcdev_group_ops,
+	.ct_attrs = pcdev_group_attrs,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem pcdev_subsys = {
+	.su_group = {
+		.cg_item = {
+			.ci_namebuf = "pcdev",
+			.ci_type = &pcdev_group_type,
+		},
+	},
+};
+
+static void static_devices_unregister(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(platform_pcdevs); i++)
+		platform_device_unregister(platform_pcdevs[i]);
+}
+
 static int __init pcdev_platform_init(void)
 {
-	platform_add_devices(platform_pcdevs, ARRAY_SIZE(platform_pcdevs));
+	int ret;
+
+	ret = platform_add_devices(platform_pcdevs,
+				   ARRAY_SIZE(platform_pcdevs));
+	if (ret)
+		return ret;
+
+	if (nr_bench_devices) {
+		ret = bench_devices_register();
+		if (ret)
+			goto unreg_static;
+	}
+
+	config_group_init(&pcdev_subsys.su_group);
+	mutex_init(&pcdev_subsys.su_mutex);
+	ret = configfs_register_subsystem(&pcdev_subsys);
+	if (ret) {
+		pr_err("configfs_register_subsystem failed!");
+		goto unreg_bench;
+	}
 
 	pr_info("Device setup module loaded");
 
 	return 0;
+
+unreg_bench:
+	if (nr_bench_devices)
+		bench_devices_unregister(nr_bench_devices);
+unreg_static:
+	static_devices_unregister();
+	return ret;
 }
 
 static void __exit pcdev_platform_exit(void)
 {
-	platform_device_unregister(&platform_pcdev_1);
-	platform_device_unregister(&platform_pcdev_2);
-	platform_device_unregister(&platform_pcdev_3);
-	platform_device_unregister(&platform_pcdev_4);
+	/* configfs holds a module reference while any item exists, so only
+	 * the empty subsystem is left at this point */
+	configfs_unregister_subsystem(&pcdev_subsys);
+	ida_destroy(&pcdev_id_ida);
+
+	if (nr_bench_devices)
+		bench_devices_unregister(nr_bench_devices);
+
+	static_devices_unregister();
 
 	pr_info("Device setup module unloaded");
 }
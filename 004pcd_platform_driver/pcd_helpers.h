@@ -0,0 +1,55 @@
+#ifndef _PCD_HELPERS_H
+#define _PCD_HELPERS_H
+
+/* Boundary checks of the pcd platform driver, shared with pcd_test.c */
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/overflow.h>
+#include "platform.h"
+
+static inline int check_permission(int dev_perm, int acc_mode)
+{
+	if (dev_perm == RDWR)
+		return 0;
+	else if ((dev_perm == RDONLY) && (acc_mode & FMODE_READ)
+		&& !(acc_mode & FMODE_WRITE))
+		return 0;
+	else if ((dev_perm == WRONLY) && (acc_mode & FMODE_WRITE)
+		&& !(acc_mode & FMODE_READ))
+		return 0;
+
+	return -EPERM;
+}
+
+/*
+ * Number of bytes of a 'count' byte transfer at 'pos' that lie inside a
+ * device of 'max_size' bytes: 0 at or past its end, never more than what
+ * is left before it, however large 'count' is.
+ */
+static inline size_t pcd_clamp_count(loff_t pos, size_t count,
+				     loff_t max_size)
+{
+	if ((pos < 0) || (pos >= max_size))
+		return 0;
+
+	return min_t(u64, count, max_size - pos);
+}
+
+/*
+ * File position 'off' bytes away from 'base', or -EINVAL if it lies outside
+ * [0, max_size], including when the sum does not even fit in a loff_t.
+ */
+static inline loff_t pcd_seek_pos(loff_t base, loff_t off, loff_t max_size)
+{
+	loff_t pos;
+
+	if (check_add_overflow(base, off, &pos))
+		return -EINVAL;
+	if ((pos > max_size) || (pos < 0))
+		return -EINVAL;
+
+	return pos;
+}
+
+#endif /* _PCD_HELPERS_H */
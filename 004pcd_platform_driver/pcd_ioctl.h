@@ -0,0 +1,102 @@
+#ifndef _PCD_IOCTL_H
+#define _PCD_IOCTL_H
+
+/* ioctl and record interface of the pcd platform driver, shared with user
+ * space */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Direction of a transfer */
+#define PCD_SG_READ  0x00
+#define PCD_SG_WRITE 0x01
+
+/* Most descriptors a single PCD_IOC_SG call accepts */
+#define PCD_SG_MAX 1024
+
+/* One transfer between the device and a user buffer */
+struct pcd_sg_desc {
+	__u64 offset;	/* device offset */
+	__u64 addr;	/* user buffer */
+	__u32 len;	/* bytes to transfer */
+	__u32 dir;	/* PCD_SG_READ or PCD_SG_WRITE */
+	__s64 result;	/* out: bytes transferred or -errno */
+};
+
+/* A batch of transfers, run in order by one PCD_IOC_SG call */
+struct pcd_sg_batch {
+	__u64 descs;	/* user pointer to 'count' struct pcd_sg_desc */
+	__u32 count;
+	__u32 flags;	/* must be 0 */
+};
+
+#define PCD_IOC_MAGIC 'p'
+
+#define PCD_IOC_SG _IOW(PCD_IOC_MAGIC, 1, struct pcd_sg_batch)
+
+/*
+ * Takes a copy-on-write snapshot of a flat device, readable through the
+ * read-only node /dev/pcdev-<id>-snap until the next snapshot replaces it.
+ * Only a PCD_RECLAIM_DISCARD device drops it earlier, under memory
+ * pressure, once neither the device nor the snapshot node is open. Fails
+ * with EPERM unless the file was opened for reading, and with EBUSY while
+ * the device is mapped or exported.
+ */
+#define PCD_IOC_SNAPSHOT _IO(PCD_IOC_MAGIC, 2)
+
+/* Flags of struct pcd_export */
+#define PCD_EXPORT_RDWR    0x01	/* importers may write, not just read */
+#define PCD_EXPORT_CLOEXEC 0x02	/* the dma-buf fd is close-on-exec */
+
+/* Export of a whole flat device as a dma-buf */
+struct pcd_export {
+	__u32 flags;	/* PCD_EXPORT_* */
+	__s32 fd;	/* out: dma-buf file descriptor */
+};
+
+/* Largest device that can be exported: an export pins all of its pages */
+#define PCD_EXPORT_MAX (256ULL << 20)
+
+/*
+ * Shares the pages of a flat device with other processes and drivers
+ * through a dma-buf. The device counts as mapped while the dma-buf lives.
+ * Fails with EFBIG for devices larger than PCD_EXPORT_MAX.
+ */
+#define PCD_IOC_EXPORT _IOWR(PCD_IOC_MAGIC, 3, struct pcd_export)
+
+/*
+ * A PCD_MODE_RECORD device turns every write() of up to PCD_RECORD_MAX
+ * bytes into one record. read() returns whole records, each one a header
+ * immediately followed by its data, in 'seq' order. A read that finds that
+ * records were overwritten before they could be read fails once with
+ * EPIPE; the gap also shows in 'seq'. A record still being stored on one
+ * CPU while a later one is read may come after it, so EPIPE is what
+ * reliably reports a loss.
+ *
+ * A PCD_MODE_SHARDED device frames the records it returns the same way,
+ * merged from all CPUs by 'ts_ns'. Records it drops only show as a gap in
+ * 'seq'.
+ */
+#define PCD_RECORD_MAX 2048
+
+struct pcd_record {
+	__u64 seq;	/* 1 for the first record written to the device */
+	__u64 ts_ns;	/* CLOCK_MONOTONIC time of the write */
+	__u32 len;	/* bytes of data following the header */
+	__u32 flags;	/* 0 */
+};
+
+/*
+ * With the relay_subbufs module parameter set, what is written to a device
+ * is also streamed to the files relay<cpu> of its debugfs directory, in
+ * chunks of at most a page, each one preceded by this header. A chunk that
+ * does not fit in the sub-buffers is dropped.
+ */
+struct pcd_relay_chunk {
+	__u64 ts_ns;	/* CLOCK_MONOTONIC time of the write */
+	__s64 pos;	/* device offset of the data, -1 without a position */
+	__u32 len;	/* bytes of data following the header */
+	__u32 pad;	/* 0 */
+};
+
+#endif /* _PCD_IOCTL_H */
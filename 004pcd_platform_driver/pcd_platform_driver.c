@@ -4,242 +4,3557 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/seqlock.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
+#include <linux/xarray.h>
+#include <linux/idr.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/log2.h>
 #include <linux/mod_devicetable.h>
+#include <linux/nodemask.h>
+#include <linux/overflow.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/highmem.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/workqueue.h>
+#include <linux/string.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/genhd.h>
+#include <linux/bvec.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/vmalloc.h>
+#include <linux/ring_buffer.h>
+#include <linux/relay.h>
+#include <linux/shrinker.h>
+#include <linux/bitmap.h>
+#include <linux/list.h>
+#include <linux/kobject.h>
 #include "platform.h"
+#include "pcd_ioctl.h"
+#include "pcd_helpers.h"
+
+#define CREATE_TRACE_POINTS
+#include "pcd_trace.h"
 
 #undef pr_fmt
 #define pr_fmt(fmt) "[%s:%d] " fmt, __func__, __LINE__
 
-/* Maximum number of devices this driver supports. */
-#define MAX_DEVICES (10)
+/* Maximum number of devices this driver supports: the whole minor range of
+ * its major number is reserved and handed out on demand. */
+#define MAX_DEVICES (MINORMASK + 1)
+
+int pcd_open(struct inode *inode, struct file *filp);
+int pcd_release(struct inode *inode, struct file *flip);
+ssize_t pcd_read(struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write(struct kiocb *iocb, struct iov_iter *from);
+loff_t pcd_lseek(struct file *filp, loff_t offset, int whence);
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma);
+__poll_t pcd_poll(struct file *filp, struct poll_table_struct *wait);
+ssize_t pcd_splice_read(struct file *in, loff_t *ppos,
+			struct pipe_inode_info *pipe, size_t len,
+			unsigned int flags);
+long pcd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int pcd_fsync(struct file *filp, loff_t start, loff_t end, int datasync);
+
+int pcd_snap_open(struct inode *inode, struct file *filp);
+int pcd_snap_release(struct inode *inode, struct file *filp);
+ssize_t pcd_snap_read(struct kiocb *iocb, struct iov_iter *to);
+loff_t pcd_snap_lseek(struct file *filp, loff_t offset, int whence);
+
+int pcd_platform_driver_probe(struct platform_device *pdev);
+int pcd_platform_driver_remove(struct platform_device *pdev);
+
+enum pcdev_names {
+	PCDEVA1X = 0,
+	PCDEVB1X,
+	PCDEVC1X,
+	PCDEVD1X,
+	PCDEVE1X
+};
+
+struct device_config {
+	int config_item1;
+	int config_item2;
+};
+
+/* Configuration data of the driver for devices */
+struct device_config pcdev_config[] = {
+	[PCDEVA1X] = {.config_item1 = 60, .config_item2 = 21},
+	[PCDEVB1X] = {.config_item1 = 50, .config_item2 = 22},
+	[PCDEVC1X] = {.config_item1 = 40, .config_item2 = 23},
+	[PCDEVD1X] = {.config_item1 = 30, .config_item2 = 24},
+	[PCDEVE1X] = {.config_item1 = 20, .config_item2 = 25}
+};
+
+/* I/O statistics kept per device */
+enum pcd_stat_item {
+	PCD_STAT_BYTES_READ = 0,
+	PCD_STAT_BYTES_WRITTEN,
+	PCD_STAT_READS,
+	PCD_STAT_WRITES,
+	PCD_STAT_SHORT_READS,
+	PCD_STAT_SHORT_WRITES,
+	PCD_STAT_EFAULT,
+	PCD_STAT_ENOMEM,
+	PCD_STAT_EPERM,
+	PCD_STAT_MAX
+};
+
+/* Per-CPU copy of the statistics, summed up when read through sysfs */
+struct pcdev_stats {
+	u64_stats_t item[PCD_STAT_MAX];
+	struct u64_stats_sync syncp;
+};
+
+/* Operations whose latency is recorded in the debugfs histograms */
+enum pcd_lat_op {
+	PCD_LAT_OPEN = 0,
+	PCD_LAT_READ,
+	PCD_LAT_WRITE,
+	PCD_LAT_LSEEK,
+	PCD_LAT_MAX
+};
+
+/* Transfer size classes: none, then up to 64 bytes, 512 bytes, ... each
+ * eight times larger than the previous one; the last one is unbounded */
+#define PCD_LAT_SIZES 8
+/* Latency buckets: bucket n counts latencies in [2^n, 2^(n+1)) ns */
+#define PCD_LAT_BUCKETS 32
+
+/* Per-CPU latency histograms, summed up when read through debugfs */
+struct pcdev_lat {
+	u64 count[PCD_LAT_MAX][PCD_LAT_SIZES][PCD_LAT_BUCKETS];
+};
+
+/* Largest number of bytes a single flat write() stages and applies at once */
+#define PCD_MAX_WRITE (SZ_1M)
+
+/* The same for a write that may not sleep, staged in a single page */
+#define PCD_MAX_NOWAIT_WRITE (PAGE_SIZE)
+
+/* Largest ring of a PCD_MODE_SPSC device, its cursors are 32 bit wide */
+#define PCD_MAX_RING (SZ_1G)
+
+/* Roles taken by the open files of a PCD_MODE_SPSC device */
+#define PCD_RING_CONSUMER 0
+#define PCD_RING_PRODUCER 1
+
+/*
+ * PCD_MODE_SPSC ring. 'head' and 'tail' run freely and are masked to index
+ * the buffer; each one is written by a single side and lives in its own
+ * cacheline, so that the two sides share no lock. Each side has a mutex of
+ * its own, as the threads of a process may share the file of one side; it
+ * is only ever taken by that side, so it is not contended otherwise.
+ */
+struct pcdev_ring {
+	/* producer side */
+	unsigned int head ____cacheline_aligned_in_smp;
+	bool writer_waiting;
+	struct mutex write_lock;
+	/* consumer side */
+	unsigned int tail ____cacheline_aligned_in_smp;
+	bool reader_waiting;
+	struct mutex read_lock;
+	/* read mostly */
+	unsigned int mask ____cacheline_aligned_in_smp;
+	unsigned long owners;
+};
+
+/*
+ * Per-CPU shard of a PCD_MODE_SHARDED device: a ring of records that only
+ * its own CPU appends to. Its lock is only ever contended by readers, and
+ * 'head' and 'tail' run freely like the cursors of the SPSC ring.
+ */
+struct pcdev_shard {
+	spinlock_t lock;
+	unsigned int head;
+	unsigned int tail;
+	/* records dropped to make room that no reader has accounted for */
+	unsigned long dropped;
+	char *buf;
+};
+
+/* Header of each record in a shard, followed by 'len' bytes of data */
+struct pcd_shard_rec {
+	u64 ts;
+	u32 len;
+	u32 pad;
+};
+
+/* Largest record; every shard has room for at least two of them */
+#define PCD_SHARD_MAX_RECORD (PAGE_SIZE - sizeof(struct pcd_shard_rec))
+/* Records up to this size are staged on the stack rather than allocated */
+#define PCD_SHARD_STACK_RECORD 256
+
+/* Device pages still shared with the current snapshot, see pcd_snapshot() */
+#define PCD_PAGE_SHARED XA_MARK_0
+/* Device pages written since they were last written back */
+#define PCD_PAGE_DIRTY XA_MARK_1
+
+/* Largest single write to a backing file */
+#define PCD_WB_BATCH (SZ_256K)
+
+/*
+ * Point-in-time copy of a flat device. It holds a reference on every page
+ * the device had when it was taken; the device stops sharing a page by
+ * copying it before its first write.
+ */
+struct pcdev_snapshot {
+	struct kref ref;
+	loff_t size;
+	struct xarray pages;
+};
+
+/* Device private data structure */
+struct pcdev_private_data {
+	/* the platform device and both cdevs hold a reference, see
+	 * pcd_priv_release() */
+	struct kobject kobj;
+	/* set once the platform device is gone, under snap_lock */
+	bool removed;
+	struct pcdev_platform_data pdata;
+	/* platform device id, used to tell devices apart in traces */
+	int id;
+	/* device storage: one page per index, allocated on first write */
+	struct xarray pages;
+	/* node the pages are allocated on, unless they are interleaved */
+	int node;
+	/* lets readers run in parallel while keeping them consistent
+	 * with writers */
+	seqlock_t lock;
+	struct pcdev_stats __percpu *stats;
+	/* latency histograms, allocated when first enabled */
+	struct pcdev_lat __percpu *lat;
+	bool lat_enabled;
+	struct dentry *debugfs;
+	/* copy of everything written, when relay_subbufs is set; writers
+	 * use it under pcd_relay_srcu */
+	struct rchan __rcu *relay;
+	struct pcdev_ring ring;
+	/* PCD_MODE_SHARDED records, one ring per possible CPU */
+	struct pcdev_shard __percpu *shards;
+	unsigned int shard_mask;
+	/* readers consume the merged records one at a time */
+	struct mutex shard_read_lock;
+	/* 'seq' of the last record read, under shard_read_lock */
+	u64 shard_seq;
+	/* PCD_MODE_RECORD records */
+	struct trace_buffer *records;
+	atomic64_t rec_seq;
+	/* serialises readers, protects the fields below */
+	struct mutex rec_read_lock;
+	/* consumed record not returned yet */
+	char *rec_pending;
+	size_t rec_pending_len;
+	/* records were overwritten and that was not reported yet */
+	bool rec_lost;
+	wait_queue_head_t read_wq;
+	wait_queue_head_t write_wq;
+	/* held for reading while pages are written, for writing while a
+	 * snapshot starts sharing them */
+	struct rw_semaphore snap_rwsem;
+	/* protects 'snap' and the companion device node */
+	struct mutex snap_lock;
+	struct pcdev_snapshot *snap;
+	/* snapshots are refused while the device is mapped or exported */
+	atomic_t nr_mappings;
+	/* optional file the device is loaded from and written back to */
+	struct file *backing;
+	struct delayed_work wb_work;
+	/* serialises write-back passes */
+	struct mutex wb_lock;
+	/* first write-back error not reported by fsync() yet */
+	int wb_err;
+	/* a mapping or an export went away since the last pass that wrote
+	 * every page */
+	atomic_t wb_full;
+	/* pages in 'pages', for the shrinker */
+	atomic_long_t nr_pages;
+	/* pages the shrinker dropped that the backing file still holds */
+	unsigned long *evicted;
+	/* open files, only counted for devices that may be reclaimed */
+	atomic_t nr_open;
+	/* set while the shrinker frees pages, opens wait on reclaim_wq */
+	bool reclaiming;
+	wait_queue_head_t reclaim_wq;
+	/* entry in pcd_devices, if the device may be reclaimed */
+	struct list_head node;
+	dev_t dev_num;
+	struct cdev cdev;
+	struct device *device;
+	/* read-only companion node of the snapshot, created on first use */
+	dev_t snap_num;
+	struct cdev snap_cdev;
+	struct device *snap_device;
+	/* block device front end, if enabled */
+	struct blk_mq_tag_set tag_set;
+	struct gendisk *disk;
+};
+
+/* Driver private data structure */
+struct pcdrv_private_data {
+	/* devices may be probed in parallel */
+	atomic_t total_devices;
+	dev_t device_num_base;
+	struct class * class_pcd;
+	/* major number of the block devices, 0 if there are none */
+	int blk_major;
+};
+
+/* file operations of the driver */
+struct file_operations pcd_fops =
+{
+	.open = pcd_open,
+	.release = pcd_release,
+	.read_iter = pcd_read,
+	.write_iter = pcd_write,
+	.llseek = pcd_lseek,
+	.mmap = pcd_mmap,
+	.poll = pcd_poll,
+	.fsync = pcd_fsync,
+	.splice_read = pcd_splice_read,
+	.splice_write = iter_file_splice_write,
+	.unlocked_ioctl = pcd_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.owner = THIS_MODULE
+};
+
+/* file operations of the snapshot nodes */
+struct file_operations pcd_snap_fops =
+{
+	.open = pcd_snap_open,
+	.release = pcd_snap_release,
+	.read_iter = pcd_snap_read,
+	.llseek = pcd_snap_lseek,
+	.owner = THIS_MODULE
+};
+
+struct platform_device_id pcdevs_ids[] = {
+	[0] = {.name = "pcdev-A1x", .driver_data = PCDEVA1X},
+	[1] = {.name = "pcdev-B1x", .driver_data = PCDEVB1X},
+	[2] = {.name = "pcdev-C1x", .driver_data = PCDEVC1X},
+	[3] = {.name = "pcdev-D1x", .driver_data = PCDEVD1X},
+	[4] = {.name = "pcdev-E1x", .driver_data = PCDEVE1X},
+	{}
+};
+
+struct platform_driver pcd_platform_driver =
+{
+	.probe = pcd_platform_driver_probe,
+	.remove = pcd_platform_driver_remove,
+	.id_table = pcdevs_ids,
+	.driver = {
+		.name = PCD_DRIVER_NAME,
+		/* probe devices in parallel, off the module loading path */
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	}
+};
+
+/* Driver private data structure */
+static struct pcdrv_private_data pcdrv_private_data;
+
+/* Minor numbers in use, reused once their device is removed */
+static DEFINE_IDA(pcd_minor_ida);
+
+/* How long written data may sit in memory before it is written back */
+static unsigned int writeback_delay_ms = 1000;
+module_param(writeback_delay_ms, uint, 0644);
+MODULE_PARM_DESC(writeback_delay_ms, "Delay before dirty pages are written back");
+
+/* Set while any device records latencies, see pcd_lat_start() */
+static DEFINE_STATIC_KEY_FALSE(pcd_lat_key);
+/* Serialises enabling and disabling the latency histograms */
+static DEFINE_MUTEX(pcd_lat_mutex);
+static struct dentry *pcd_debugfs_root;
+
+/* Devices the shrinker may take pages from */
+static LIST_HEAD(pcd_devices);
+static DEFINE_MUTEX(pcd_devices_lock);
+
+/* Also expose flat devices as block devices */
+static bool blkdev;
+module_param(blkdev, bool, 0444);
+MODULE_PARM_DESC(blkdev, "Expose flat devices as /dev/pcdblk<id> too");
+
+/* Geometry of the per-CPU relay buffers, none when 'relay_subbufs' is 0 */
+static unsigned int relay_subbufs;
+module_param(relay_subbufs, uint, 0444);
+MODULE_PARM_DESC(relay_subbufs, "Sub-buffers per CPU of the relay channel of each device, 0 for none");
+static unsigned int relay_subbuf_size = SZ_256K;
+module_param(relay_subbuf_size, uint, 0444);
+MODULE_PARM_DESC(relay_subbuf_size, "Size of each relay sub-buffer");
+/* Lets a relay channel be closed once the writers still using it are done */
+DEFINE_STATIC_SRCU(pcd_relay_srcu);
+
+static void pcd_stats_inc(struct pcdev_private_data *priv,
+			  enum pcd_stat_item item)
+{
+	struct pcdev_stats *stats = get_cpu_ptr(priv->stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	u64_stats_inc(&stats->item[item]);
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(priv->stats);
+}
+
+/* Accounts the result of one read or write call on this CPU */
+static void pcd_stats_rw(struct pcdev_private_data *priv, bool write,
+			 size_t requested, ssize_t ret)
+{
+	struct pcdev_stats *stats = get_cpu_ptr(priv->stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	u64_stats_inc(&stats->item[write ? PCD_STAT_WRITES : PCD_STAT_READS]);
+	if (ret >= 0) {
+		u64_stats_add(&stats->item[write ? PCD_STAT_BYTES_WRITTEN :
+				       PCD_STAT_BYTES_READ], ret);
+		if (ret < requested)
+			u64_stats_inc(&stats->item[write ?
+				      PCD_STAT_SHORT_WRITES :
+				      PCD_STAT_SHORT_READS]);
+	} else if (ret == -EFAULT) {
+		u64_stats_inc(&stats->item[PCD_STAT_EFAULT]);
+	} else if (ret == -ENOMEM) {
+		u64_stats_inc(&stats->item[PCD_STAT_ENOMEM]);
+	}
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(priv->stats);
+}
+
+static u64 pcd_stats_sum(struct pcdev_private_data *priv,
+			 enum pcd_stat_item item)
+{
+	struct pcdev_stats *stats;
+	unsigned int start;
+	u64 sum = 0;
+	u64 val;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(priv->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			val = u64_stats_read(&stats->item[item]);
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+		sum += val;
+	}
+
+	return sum;
+}
+
+/*
+ * Latency histograms. Each operation reads the clock twice, and only while
+ * some device has its histograms enabled; otherwise the static key makes
+ * the whole thing a patched out branch.
+ */
+static u64 pcd_lat_start(void)
+{
+	if (static_branch_unlikely(&pcd_lat_key))
+		return ktime_get_ns();
+	return 0;
+}
+
+static unsigned int pcd_lat_size(size_t size)
+{
+	int order;
+
+	if (!size)
+		return 0;
+
+	order = (fls64(size - 1) - 4) / 3;
+	return clamp(order, 0, PCD_LAT_SIZES - 2) + 1;
+}
+
+static void pcd_lat_end(struct pcdev_private_data *priv, enum pcd_lat_op op,
+			size_t size, u64 start)
+{
+	u64 ns;
+
+	if (!static_branch_unlikely(&pcd_lat_key) || !start)
+		return;
+	/* pairs with the release in pcd_lat_enable_set() */
+	if (!smp_load_acquire(&priv->lat_enabled))
+		return;
+
+	ns = ktime_get_ns() - start;
+	this_cpu_inc(priv->lat->count[op][pcd_lat_size(size)]
+				 [ns ? min(ilog2(ns), PCD_LAT_BUCKETS - 1) : 0]);
+}
+
+/*
+ * Node page 'index' of the device should live on. Interleaved devices
+ * spread consecutive pages over the online nodes, so that a sequential
+ * scan draws on the bandwidth of all of them.
+ */
+static int pcd_page_node(struct pcdev_private_data *priv, pgoff_t index)
+{
+	unsigned int nth;
+	int nid;
+
+	if (priv->pdata.numa_policy != PCD_NUMA_INTERLEAVE)
+		return priv->node;
+
+	nth = index % num_online_nodes();
+	nid = first_online_node;
+	while (nth-- && nid < MAX_NUMNODES)
+		nid = next_online_node(nid);
+
+	/* a node went offline under us, let the allocator choose */
+	return nid < MAX_NUMNODES ? nid : NUMA_NO_NODE;
+}
+
+/*
+ * Reads page 'index' back from the backing file after the shrinker dropped
+ * it. Returns NULL if that fails, or can not be done without sleeping.
+ */
+static struct page *pcd_reload_page(struct pcdev_private_data *priv,
+				    pgoff_t index, gfp_t gfp)
+{
+	loff_t pos = (loff_t)index << PAGE_SHIFT;
+	struct page *page;
+	struct page *old;
+	ssize_t n;
+
+	if (!gfpflags_allow_blocking(gfp))
+		return NULL;
+
+	page = alloc_pages_node(pcd_page_node(priv, index), gfp | __GFP_ZERO, 0);
+	if (!page)
+		return NULL;
+
+	/* the rest of a short file reads as zeros */
+	n = kernel_read(priv->backing, page_address(page),
+			min_t(loff_t, PAGE_SIZE, priv->pdata.size - pos), &pos);
+	if (n < 0) {
+		__free_page(page);
+		return NULL;
+	}
+
+	old = xa_cmpxchg(&priv->pages, index, NULL, page, gfp);
+	if (old) {
+		__free_page(page);
+		return xa_is_err(old) ? NULL : old;
+	}
+	clear_bit(index, priv->evicted);
+	atomic_long_inc(&priv->nr_pages);
+
+	return page;
+}
+
+/*
+ * Returns the page backing page 'index' of the device, allocating a zeroed
+ * one on the node chosen by the device placement policy if the index is
+ * still a hole. Returns NULL if no memory is available.
+ */
+static struct page *pcd_get_page(struct pcdev_private_data *priv,
+				 pgoff_t index, gfp_t gfp)
+{
+	struct page *page;
+	struct page *old;
+
+	page = xa_load(&priv->pages, index);
+	if (page)
+		return page;
+
+	/* not a hole, but a page the shrinker dropped */
+	if (priv->evicted && test_bit(index, priv->evicted))
+		return pcd_reload_page(priv, index, gfp);
+
+	page = alloc_pages_node(pcd_page_node(priv, index), gfp | __GFP_ZERO, 0);
+	if (!page)
+		return NULL;
+
+	/* somebody else may have filled the hole in the meantime */
+	old = xa_cmpxchg(&priv->pages, index, NULL, page, gfp);
+	if (old) {
+		__free_page(page);
+		return xa_is_err(old) ? NULL : old;
+	}
+	atomic_long_inc(&priv->nr_pages);
+
+	return page;
+}
+
+/* Reads back the pages of [pos, pos + count) the shrinker dropped */
+static int pcd_reload(struct pcdev_private_data *priv, loff_t pos,
+		      size_t count)
+{
+	unsigned long index = pos >> PAGE_SHIFT;
+	unsigned long last;
+
+	if (!priv->evicted || !count)
+		return 0;
+
+	last = (pos + count - 1) >> PAGE_SHIFT;
+	for_each_set_bit_from(index, priv->evicted, last + 1)
+		if (!pcd_get_page(priv, index, GFP_KERNEL))
+			return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Gives the device its own copy of page 'index', which it shares with a
+ * snapshot. The caller holds snap_rwsem for reading, so the page can not
+ * become shared again before it is written.
+ */
+static int pcd_unshare_page(struct pcdev_private_data *priv, pgoff_t index,
+			    gfp_t gfp)
+{
+	struct page *old;
+	struct page *new;
+	struct page *cur;
+
+	/* the caller saw the mark without the lock: another writer may have
+	 * unshared the page since, and may be writing to it already */
+	xa_lock(&priv->pages);
+	if (!xa_get_mark(&priv->pages, index, PCD_PAGE_SHARED)) {
+		xa_unlock(&priv->pages);
+		return 0;
+	}
+	old = xa_load(&priv->pages, index);
+
+	/* nobody else holds the page any more, it can be reused as is */
+	if (page_count(old) == 1) {
+		__xa_clear_mark(&priv->pages, index, PCD_PAGE_SHARED);
+		xa_unlock(&priv->pages);
+		return 0;
+	}
+
+	/* keeps the page around while it is copied */
+	get_page(old);
+	xa_unlock(&priv->pages);
+
+	new = alloc_pages_node(pcd_page_node(priv, index), gfp, 0);
+	if (!new) {
+		put_page(old);
+		return -ENOMEM;
+	}
+	copy_highpage(new, old);
+
+	xa_lock(&priv->pages);
+	cur = __xa_cmpxchg(&priv->pages, index, old, new, gfp);
+	if (cur == old)
+		__xa_clear_mark(&priv->pages, index, PCD_PAGE_SHARED);
+	xa_unlock(&priv->pages);
+
+	/* another writer got there first */
+	if (cur != old) {
+		__free_page(new);
+		put_page(old);
+		return xa_is_err(cur) ? xa_err(cur) : 0;
+	}
+
+	/* our reference and the one the device had */
+	put_page(old);
+	put_page(old);
+	return 0;
+}
+
+/*
+ * Allocates every page of [pos, pos + count) that is still a hole and
+ * stops sharing the ones a snapshot holds, so that they can be written.
+ */
+static int pcd_populate(struct pcdev_private_data *priv, loff_t pos,
+			size_t count, gfp_t gfp)
+{
+	pgoff_t index;
+	pgoff_t last;
+	int ret;
+
+	if (!count)
+		return 0;
+
+	last = (pos + count - 1) >> PAGE_SHIFT;
+	for (index = pos >> PAGE_SHIFT; index <= last; index++) {
+		if (!pcd_get_page(priv, index, gfp))
+			return -ENOMEM;
+		if (xa_get_mark(&priv->pages, index, PCD_PAGE_SHARED)) {
+			ret = pcd_unshare_page(priv, index, gfp);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns page 'index' with a reference held, NULL for a hole. A page can
+ * be replaced and freed at any time once a snapshot shares it, so it is
+ * looked up again after being pinned, the way the page cache does it.
+ */
+static struct page *pcd_pin_page(struct xarray *pages, pgoff_t index)
+{
+	struct page *page;
+
+	rcu_read_lock();
+repeat:
+	page = xa_load(pages, index);
+	if (page) {
+		if (!get_page_unless_zero(page))
+			goto repeat;
+		if (unlikely(page != xa_load(pages, index))) {
+			put_page(page);
+			goto repeat;
+		}
+	}
+	rcu_read_unlock();
+
+	return page;
+}
+
+/* Copies data from 'pages' to the iterator; holes read as zeros */
+static size_t pcd_copy_to_iter(struct xarray *pages, loff_t pos,
+			       size_t count, struct iov_iter *to)
+{
+	struct page *page;
+	size_t copied = 0;
+	size_t offset;
+	size_t chunk;
+	size_t n;
+
+	while (copied < count) {
+		offset = offset_in_page(pos + copied);
+		chunk = min_t(size_t, count - copied, PAGE_SIZE - offset);
+		page = pcd_pin_page(pages, (pos + copied) >> PAGE_SHIFT);
+		if (page) {
+			n = copy_page_to_iter(page, offset, chunk, to);
+			put_page(page);
+		} else {
+			n = iov_iter_zero(chunk, to);
+		}
+		copied += n;
+		if (n < chunk)
+			break;
+	}
+
+	return copied;
+}
+
+/* Copies data from the iterator to the device, allocating pages as needed */
+static ssize_t pcd_copy_from_iter(struct pcdev_private_data *priv, loff_t pos,
+				  size_t count, struct iov_iter *from,
+				  gfp_t gfp)
+{
+	struct page *page;
+	size_t copied = 0;
+	size_t offset;
+	size_t chunk;
+	size_t n;
+
+	while (copied < count) {
+		offset = offset_in_page(pos + copied);
+		chunk = min_t(size_t, count - copied, PAGE_SIZE - offset);
+		page = pcd_get_page(priv, (pos + copied) >> PAGE_SHIFT, gfp);
+		if (!page)
+			return copied ? copied : -ENOMEM;
+		n = copy_page_from_iter(page, offset, chunk, from);
+		copied += n;
+		if (n < chunk)
+			break;
+	}
+
+	return copied;
+}
+
+/* Copies a kernel buffer to pages that pcd_populate() already allocated */
+static void pcd_copy_to_pages(struct pcdev_private_data *priv, loff_t pos,
+			      const char *buf, size_t count)
+{
+	struct page *page;
+	size_t copied = 0;
+	size_t offset;
+	size_t chunk;
+
+	while (copied < count) {
+		offset = offset_in_page(pos + copied);
+		chunk = min_t(size_t, count - copied, PAGE_SIZE - offset);
+		page = xa_load(&priv->pages, (pos + copied) >> PAGE_SHIFT);
+		memcpy(page_address(page) + offset, buf + copied, chunk);
+		copied += chunk;
+	}
+}
+
+static void pcd_free_pages(struct pcdev_private_data *priv)
+{
+	struct page *page;
+	unsigned long index;
+
+	xa_for_each(&priv->pages, index, page)
+		put_page(page);
+	xa_destroy(&priv->pages);
+}
+
+/*
+ * Write-back to the backing file. Writes only mark the pages they touched
+ * dirty; a delayed work item later writes all dirty pages at once, merging
+ * runs of consecutive pages, so that no file I/O is done by the writers.
+ */
+static void pcd_mark_dirty(struct pcdev_private_data *priv, loff_t pos,
+			   size_t count)
+{
+	pgoff_t index;
+	pgoff_t last;
+
+	if (!priv->backing || !count)
+		return;
+
+	last = (pos + count - 1) >> PAGE_SHIFT;
+	for (index = pos >> PAGE_SHIFT; index <= last; index++)
+		xa_set_mark(&priv->pages, index, PCD_PAGE_DIRTY);
+
+	/* does nothing if a write-back is already due */
+	queue_delayed_work(system_unbound_wq, &priv->wb_work,
+			   msecs_to_jiffies(writeback_delay_ms));
+}
+
+/*
+ * Stores through a mapping or an export are not seen page by page: once it
+ * goes away, every page it could have written is due for write-back.
+ */
+static void pcd_mark_all_dirty(struct pcdev_private_data *priv)
+{
+	struct page *page;
+	unsigned long index;
+
+	if (!priv->backing)
+		return;
+
+	atomic_set(&priv->wb_full, 1);
+	xa_for_each(&priv->pages, index, page)
+		xa_set_mark(&priv->pages, index, PCD_PAGE_DIRTY);
+
+	queue_delayed_work(system_unbound_wq, &priv->wb_work,
+			   msecs_to_jiffies(writeback_delay_ms));
+}
+
+/* Copies a consistent image of page 'index' to 'buf' */
+static void pcd_wb_copy(struct pcdev_private_data *priv, pgoff_t index,
+			char *buf)
+{
+	struct page *page;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&priv->lock);
+		page = pcd_pin_page(&priv->pages, index);
+		if (page) {
+			memcpy(buf, page_address(page), PAGE_SIZE);
+			put_page(page);
+		} else {
+			memset(buf, 0, PAGE_SIZE);
+		}
+	} while (read_seqretry(&priv->lock, seq));
+}
+
+/* Writes a run of pages starting at page 'first'; marks it dirty again if
+ * that fails, so that the next pass retries it */
+static int pcd_wb_write(struct pcdev_private_data *priv, const char *buf,
+			pgoff_t first, size_t len)
+{
+	loff_t pos = (loff_t)first << PAGE_SHIFT;
+	size_t count = min_t(loff_t, len, priv->pdata.size - pos);
+	ssize_t ret;
+	pgoff_t i;
+
+	ret = kernel_write(priv->backing, buf, count, &pos);
+	if (ret == count)
+		return 0;
+
+	for (i = 0; i < len >> PAGE_SHIFT; i++)
+		xa_set_mark(&priv->pages, first + i, PCD_PAGE_DIRTY);
+	return ret < 0 ? ret : -EIO;
+}
+
+static int pcd_writeback(struct pcdev_private_data *priv)
+{
+	struct page *page;
+	unsigned long index;
+	pgoff_t first = 0;
+	size_t len = 0;
+	bool full;
+	char *buf;
+	int ret = 0;
+
+	buf = kvmalloc(PCD_WB_BATCH, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock(&priv->wb_lock);
+
+	/* stores through a mapping or an export go unnoticed, so write
+	 * every page */
+	full = atomic_xchg(&priv->wb_full, 0);
+	if (full || atomic_read(&priv->nr_mappings))
+		xa_for_each(&priv->pages, index, page)
+			xa_set_mark(&priv->pages, index, PCD_PAGE_DIRTY);
+
+	xa_for_each_marked(&priv->pages, index, page, PCD_PAGE_DIRTY) {
+		/* write the run so far if this page does not extend it */
+		if (len && ((index != first + (len >> PAGE_SHIFT)) ||
+			    (len == PCD_WB_BATCH))) {
+			ret = pcd_wb_write(priv, buf, first, len);
+			if (ret)
+				break;
+			len = 0;
+		}
+		if (!len)
+			first = index;
+
+		/* clear before copying: a later write marks the page again */
+		xa_clear_mark(&priv->pages, index, PCD_PAGE_DIRTY);
+		pcd_wb_copy(priv, index, buf + len);
+		len += PAGE_SIZE;
+	}
+	if (!ret && len)
+		ret = pcd_wb_write(priv, buf, first, len);
+
+	if (ret && !priv->wb_err)
+		priv->wb_err = ret;
+	/* the pages a failed pass did not get to still need it */
+	if (ret && full)
+		atomic_set(&priv->wb_full, 1);
+	mutex_unlock(&priv->wb_lock);
+
+	kvfree(buf);
+	return ret;
+}
+
+static void pcd_wb_work(struct work_struct *work)
+{
+	struct pcdev_private_data *priv = container_of(to_delayed_work(work),
+					struct pcdev_private_data, wb_work);
+	int ret;
+
+	ret = pcd_writeback(priv);
+	if (ret) {
+		pr_err_ratelimited("Write-back of pcdev-%d failed: %d\n",
+				   priv->id, ret);
+		queue_delayed_work(system_unbound_wq, &priv->wb_work,
+				   msecs_to_jiffies(writeback_delay_ms));
+	}
+}
+
+/* Fills the device from its backing file; pages of zeros stay holes */
+static int pcd_backing_load(struct pcdev_private_data *priv)
+{
+	loff_t max_size = priv->pdata.size;
+	struct page *page;
+	loff_t pos = 0;
+	loff_t start;
+	size_t chunk;
+	ssize_t n;
+	char *buf;
+	int ret = 0;
+
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	while (pos < max_size) {
+		start = pos;
+		chunk = min_t(loff_t, PAGE_SIZE - offset_in_page(pos),
+			      max_size - pos);
+		n = kernel_read(priv->backing, buf, chunk, &pos);
+		if (n <= 0) {
+			/* the rest of a short file reads as zeros */
+			ret = n;
+			break;
+		}
+		if (!memchr_inv(buf, 0, n))
+			continue;
+
+		page = pcd_get_page(priv, start >> PAGE_SHIFT, GFP_KERNEL);
+		if (!page) {
+			ret = -ENOMEM;
+			break;
+		}
+		memcpy(page_address(page) + offset_in_page(start), buf, n);
+	}
+
+	kfree(buf);
+	return ret;
+}
+
+/* Writes back what is left and lets go of the backing file */
+static void pcd_backing_close(struct pcdev_private_data *priv)
+{
+	int ret;
+
+	if (!priv->backing)
+		return;
+
+	cancel_delayed_work_sync(&priv->wb_work);
+	ret = pcd_writeback(priv);
+	if (ret)
+		pr_err("Final write-back of pcdev-%d failed: %d\n",
+		       priv->id, ret);
+	filp_close(priv->backing, NULL);
+	priv->backing = NULL;
+}
+
+static void pcd_snap_free(struct kref *ref)
+{
+	struct pcdev_snapshot *snap = container_of(ref, struct pcdev_snapshot, ref);
+	struct page *page;
+	unsigned long index;
+
+	xa_for_each(&snap->pages, index, page)
+		put_page(page);
+	xa_destroy(&snap->pages);
+	kfree(snap);
+}
+
+/*
+ * Memory pressure. Devices that allow it give their pages back while they
+ * are idle: no file has them open, and they are neither mapped, exported
+ * nor block devices, so that nothing can be looking at their pages. A page
+ * the backing file holds is read back from it when it is next accessed;
+ * any other page reads as zeros again. A snapshot is not in the backing
+ * file: only PCD_RECLAIM_DISCARD lets it go, first, and only while its node
+ * is not open.
+ */
+static bool pcd_reclaimable(struct pcdev_private_data *priv)
+{
+	return !priv->disk &&
+	       (priv->pdata.reclaim == PCD_RECLAIM_DISCARD ||
+		!READ_ONCE(priv->snap)) &&
+	       !atomic_read(&priv->nr_open) &&
+	       !atomic_read(&priv->nr_mappings);
+}
+
+static unsigned long pcd_reclaim(struct pcdev_private_data *priv,
+				 unsigned long nr_to_scan)
+{
+	bool discard = (priv->pdata.reclaim == PCD_RECLAIM_DISCARD);
+	struct pcdev_snapshot *snap;
+	unsigned long freed = 0;
+	unsigned long index;
+	struct page *page;
+
+	/* keeps write-back away from the pages */
+	if (!mutex_trylock(&priv->wb_lock))
+		return 0;
+
+	/* keeps opens away until the pages are gone, pairs with the
+	 * barrier in pcd_open() */
+	WRITE_ONCE(priv->reclaiming, true);
+	smp_mb();
+	if (!pcd_reclaimable(priv))
+		goto out;
+
+	/* whatever a mapping or an export stored is only in memory until a
+	 * full pass has run, whether or not its pages look dirty */
+	if (!discard && atomic_read(&priv->wb_full))
+		goto out;
+
+	/* only the device itself may hold the snapshot, opens of its node
+	 * take their reference under snap_lock */
+	if (!mutex_trylock(&priv->snap_lock))
+		goto out;
+	snap = priv->snap;
+	if (snap && (!discard || kref_read(&snap->ref) > 1)) {
+		mutex_unlock(&priv->snap_lock);
+		goto out;
+	}
+	priv->snap = NULL;
+	mutex_unlock(&priv->snap_lock);
+	if (snap)
+		kref_put(&snap->ref, pcd_snap_free);
+
+	xa_for_each(&priv->pages, index, page) {
+		if (freed >= nr_to_scan)
+			break;
+		if (!discard && xa_get_mark(&priv->pages, index, PCD_PAGE_DIRTY))
+			continue;
+		if (priv->evicted)
+			set_bit(index, priv->evicted);
+		xa_erase(&priv->pages, index);
+		put_page(page);
+		freed++;
+	}
+	atomic_long_sub(freed, &priv->nr_pages);
+
+out:
+	WRITE_ONCE(priv->reclaiming, false);
+	wake_up_all(&priv->reclaim_wq);
+	mutex_unlock(&priv->wb_lock);
+	return freed;
+}
+
+static unsigned long pcd_shrink_count(struct shrinker *shrinker,
+				      struct shrink_control *sc)
+{
+	struct pcdev_private_data *priv;
+	unsigned long count = 0;
+
+	if (!mutex_trylock(&pcd_devices_lock))
+		return 0;
+	list_for_each_entry(priv, &pcd_devices, node)
+		if (pcd_reclaimable(priv))
+			count += atomic_long_read(&priv->nr_pages);
+	mutex_unlock(&pcd_devices_lock);
+
+	return count;
+}
+
+static unsigned long pcd_shrink_scan(struct shrinker *shrinker,
+				     struct shrink_control *sc)
+{
+	struct pcdev_private_data *priv;
+	unsigned long freed = 0;
+
+	if (!mutex_trylock(&pcd_devices_lock))
+		return SHRINK_STOP;
+	list_for_each_entry(priv, &pcd_devices, node) {
+		if (freed >= sc->nr_to_scan)
+			break;
+		freed += pcd_reclaim(priv, sc->nr_to_scan - freed);
+	}
+	mutex_unlock(&pcd_devices_lock);
+
+	return freed;
+}
+
+static struct shrinker pcd_shrinker = {
+	.count_objects = pcd_shrink_count,
+	.scan_objects = pcd_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/*
+ * Streams data just written to the device into its relay channel, from
+ * which the per-CPU files in debugfs can be read or mmapped: chunks of at
+ * most a page, each one after a struct pcd_relay_chunk. The data is taken
+ * from the kernel copy the write made, never read from the writer again.
+ * Like any relay channel this one drops what does not fit, it never holds
+ * up the writer. 'pos' is -1 for the modes without a file position.
+ */
+static void pcd_relay_write(struct pcdev_private_data *priv, loff_t pos,
+			    const char *data, size_t len)
+{
+	struct pcd_relay_chunk hdr = {};
+	struct rchan *chan;
+	unsigned long flags;
+	size_t chunk;
+	char *p;
+	int idx;
+
+	if (!rcu_access_pointer(priv->relay) ||
+	    relay_subbuf_size <= sizeof(hdr))
+		return;
+	chunk = min_t(size_t, PAGE_SIZE, relay_subbuf_size - sizeof(hdr));
+	hdr.ts_ns = ktime_get_ns();
+
+	/* the channel may be closing, see pcd_debugfs_del() */
+	idx = srcu_read_lock(&pcd_relay_srcu);
+	chan = srcu_dereference(priv->relay, &pcd_relay_srcu);
+	while (chan && len) {
+		hdr.pos = pos;
+		hdr.len = min(len, chunk);
+		/* relay_reserve() leaves it to the caller to stay on the CPU
+		 * of the sub-buffer until the chunk is filled in */
+		local_irq_save(flags);
+		p = relay_reserve(chan, sizeof(hdr) + hdr.len);
+		if (p) {
+			memcpy(p, &hdr, sizeof(hdr));
+			memcpy(p + sizeof(hdr), data, hdr.len);
+		}
+		local_irq_restore(flags);
+		data += hdr.len;
+		len -= hdr.len;
+		if (pos >= 0)
+			pos += hdr.len;
+	}
+	srcu_read_unlock(&pcd_relay_srcu, idx);
+}
+
+/* The same for data a ring write left in its pages, at ring offset 'off' */
+static void pcd_relay_write_ring(struct pcdev_private_data *priv,
+				 unsigned int off, size_t len)
+{
+	struct pcdev_ring *ring = &priv->ring;
+	struct page *page;
+	size_t chunk;
+
+	while (len) {
+		off &= ring->mask;
+		chunk = min_t(size_t, len, ring->mask + 1 - off);
+		chunk = min_t(size_t, chunk, PAGE_SIZE - offset_in_page(off));
+		page = xa_load(&priv->pages, off >> PAGE_SHIFT);
+		pcd_relay_write(priv, -1, page_address(page) +
+				offset_in_page(off), chunk);
+		off += chunk;
+		len -= chunk;
+	}
+}
+
+static bool pcd_nonblock(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+	       (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+ * Wakes up the other side of the ring only if it said it is going to sleep.
+ * A burst of transfers then costs a single wakeup instead of one per call.
+ */
+static void pcd_ring_wake(bool *waiting, wait_queue_head_t *wq)
+{
+	/* order the cursor update before the check, pairs with the barrier
+	 * in pcd_ring_sleep() */
+	smp_mb();
+	if (READ_ONCE(*waiting)) {
+		WRITE_ONCE(*waiting, false);
+		wake_up_interruptible(wq);
+	}
+}
+
+static void pcd_ring_sleep(bool *waiting)
+{
+	WRITE_ONCE(*waiting, true);
+	/* pairs with the barrier in pcd_ring_wake() */
+	smp_mb();
+}
+
+static bool pcd_ring_readable(struct pcdev_ring *ring, unsigned int tail)
+{
+	return smp_load_acquire(&ring->head) != tail;
+}
+
+static bool pcd_ring_writable(struct pcdev_ring *ring, unsigned int head)
+{
+	return head - smp_load_acquire(&ring->tail) <= ring->mask;
+}
+
+/* Takes one side of the ring, which the threads sharing a file compete for */
+static int pcd_ring_lock(struct kiocb *iocb, struct mutex *lock)
+{
+	if (pcd_nonblock(iocb))
+		return mutex_trylock(lock) ? 0 : -EAGAIN;
+
+	return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+static ssize_t pcd_spsc_read(struct pcdev_private_data *priv,
+			     struct kiocb *iocb, struct iov_iter *to)
+{
+	struct pcdev_ring *ring = &priv->ring;
+	size_t count = iov_iter_count(to);
+	unsigned int tail;
+	unsigned int head;
+	unsigned int off;
+	size_t copied = 0;
+	size_t chunk;
+	ssize_t ret;
+	size_t n;
+
+	if (!count)
+		return 0;
+
+	ret = pcd_ring_lock(iocb, &ring->read_lock);
+	if (ret)
+		return ret;
+	tail = ring->tail;
+
+	while (!pcd_ring_readable(ring, tail)) {
+		if (pcd_nonblock(iocb)) {
+			ret = -EAGAIN;
+			goto unlock;
+		}
+		pcd_ring_sleep(&ring->reader_waiting);
+		if (wait_event_interruptible(priv->read_wq,
+					     pcd_ring_readable(ring, tail))) {
+			ret = -ERESTARTSYS;
+			goto unlock;
+		}
+	}
+
+	/* the acquire pairs with the producer's release of 'head', so the
+	 * data up to 'head' is visible */
+	head = smp_load_acquire(&ring->head);
+	count = min_t(size_t, count, head - tail);
+	while (copied < count) {
+		/* the data may wrap around the end of the buffer */
+		off = (tail + copied) & ring->mask;
+		chunk = min_t(size_t, count - copied, ring->mask + 1 - off);
+		n = pcd_copy_to_iter(&priv->pages, off, chunk, to);
+		copied += n;
+		if (n < chunk)
+			break;
+	}
+
+	if (!copied) {
+		ret = -EFAULT;
+		goto unlock;
+	}
+
+	/* hand the space back to the producer */
+	smp_store_release(&ring->tail, tail + copied);
+	pcd_ring_wake(&ring->writer_waiting, &priv->write_wq);
+	ret = copied;
+
+unlock:
+	mutex_unlock(&ring->read_lock);
+	return ret;
+}
+
+static ssize_t pcd_spsc_write(struct pcdev_private_data *priv,
+			      struct kiocb *iocb, struct iov_iter *from)
+{
+	struct pcdev_ring *ring = &priv->ring;
+	size_t count = iov_iter_count(from);
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int off;
+	size_t copied = 0;
+	size_t chunk;
+	ssize_t ret;
+	ssize_t n = 0;
+
+	if (!count)
+		return 0;
+
+	ret = pcd_ring_lock(iocb, &ring->write_lock);
+	if (ret)
+		return ret;
+	head = ring->head;
+
+	while (!pcd_ring_writable(ring, head)) {
+		if (pcd_nonblock(iocb)) {
+			ret = -EAGAIN;
+			goto unlock;
+		}
+		pcd_ring_sleep(&ring->writer_waiting);
+		if (wait_event_interruptible(priv->write_wq,
+					     pcd_ring_writable(ring, head))) {
+			ret = -ERESTARTSYS;
+			goto unlock;
+		}
+	}
+
+	/* the acquire pairs with the consumer's release of 'tail', so it is
+	 * done reading the space we are about to overwrite */
+	tail = smp_load_acquire(&ring->tail);
+	count = min_t(size_t, count, ring->mask + 1 - (head - tail));
+	while (copied < count) {
+		off = (head + copied) & ring->mask;
+		chunk = min_t(size_t, count - copied, ring->mask + 1 - off);
+		n = pcd_copy_from_iter(priv, off, chunk, from, nowait ?
+				       GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL);
+		if (n < 0)
+			break;
+		copied += n;
+		if (n < chunk)
+			break;
+	}
+
+	if (!copied) {
+		if (n == -ENOMEM && nowait)
+			ret = -EAGAIN;
+		else
+			ret = n < 0 ? n : -EFAULT;
+		goto unlock;
+	}
+
+	/* only this side writes the pages until 'head' moves on */
+	pcd_relay_write_ring(priv, head, copied);
+
+	/* publish the data to the consumer */
+	smp_store_release(&ring->head, head + copied);
+	pcd_ring_wake(&ring->reader_waiting, &priv->read_wq);
+	ret = copied;
+
+unlock:
+	mutex_unlock(&ring->write_lock);
+	return ret;
+}
+
+/* A ring has a single producer and a single consumer: claim the roles
+ * of this open file, or fail with -EBUSY */
+static int pcd_ring_claim(struct pcdev_ring *ring, fmode_t mode)
+{
+	if ((mode & FMODE_WRITE) &&
+	    test_and_set_bit_lock(PCD_RING_PRODUCER, &ring->owners))
+		return -EBUSY;
+
+	if ((mode & FMODE_READ) &&
+	    test_and_set_bit_lock(PCD_RING_CONSUMER, &ring->owners)) {
+		if (mode & FMODE_WRITE)
+			clear_bit_unlock(PCD_RING_PRODUCER, &ring->owners);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+static void pcd_ring_unclaim(struct pcdev_ring *ring, fmode_t mode)
+{
+	if (mode & FMODE_WRITE)
+		clear_bit_unlock(PCD_RING_PRODUCER, &ring->owners);
+	if (mode & FMODE_READ)
+		clear_bit_unlock(PCD_RING_CONSUMER, &ring->owners);
+}
+
+/*
+ * PCD_MODE_SHARDED: each write() is one record, appended to the shard of
+ * the CPU it runs on without touching anything the other CPUs write, so
+ * that writers scale with the number of cores. A record is stamped with
+ * the monotonic clock under its shard lock; readers merge the shards by
+ * that stamp. A full shard drops its oldest records, which readers see as
+ * a gap in 'seq'.
+ */
+static unsigned int pcd_shard_rec_size(size_t len)
+{
+	return sizeof(struct pcd_shard_rec) + round_up(len, 8);
+}
+
+/* Copies to and from the shard ring at free-running offset 'off' */
+static void pcd_shard_put(struct pcdev_private_data *priv,
+			  struct pcdev_shard *shard, unsigned int off,
+			  const void *src, size_t len)
+{
+	unsigned int start = off & priv->shard_mask;
+	size_t first = min_t(size_t, len, priv->shard_mask + 1 - start);
+
+	memcpy(shard->buf + start, src, first);
+	memcpy(shard->buf, src + first, len - first);
+}
+
+static void pcd_shard_get(struct pcdev_private_data *priv,
+			  struct pcdev_shard *shard, unsigned int off,
+			  void *dst, size_t len)
+{
+	unsigned int start = off & priv->shard_mask;
+	size_t first = min_t(size_t, len, priv->shard_mask + 1 - start);
+
+	memcpy(dst, shard->buf + start, first);
+	memcpy(dst + first, shard->buf, len - first);
+}
+
+static void pcd_shard_push(struct pcdev_private_data *priv, const char *data,
+			   size_t len)
+{
+	struct pcdev_shard *shard;
+	struct pcd_shard_rec rec = { .len = len };
+	struct pcd_shard_rec old;
+	unsigned int size = pcd_shard_rec_size(len);
+
+	shard = get_cpu_ptr(priv->shards);
+	spin_lock(&shard->lock);
+
+	/* make room by dropping the oldest records */
+	while (priv->shard_mask + 1 - (shard->head - shard->tail) < size) {
+		pcd_shard_get(priv, shard, shard->tail, &old, sizeof(old));
+		shard->tail += pcd_shard_rec_size(old.len);
+		shard->dropped++;
+	}
+
+	rec.ts = ktime_get_ns();
+	pcd_shard_put(priv, shard, shard->head, &rec, sizeof(rec));
+	pcd_shard_put(priv, shard, shard->head + sizeof(rec), data, len);
+	WRITE_ONCE(shard->head, shard->head + size);
+
+	spin_unlock(&shard->lock);
+	put_cpu_ptr(priv->shards);
+}
+
+/* Where pcd_shard_peek() found the record it copied */
+struct pcd_shard_pos {
+	struct pcdev_shard *shard;
+	unsigned int tail;
+	unsigned int size;
+	unsigned long dropped;
+};
+
+/*
+ * Copies the oldest record of all shards to 'buf' as a struct pcd_record
+ * followed by its data, without consuming it. Returns the size of both, 0
+ * if there is no record, or -EMSGSIZE if they are larger than 'room'.
+ */
+static ssize_t pcd_shard_peek(struct pcdev_private_data *priv, char *buf,
+			      size_t room, struct pcd_shard_pos *pos)
+{
+	struct pcd_record *hdr = (struct pcd_record *)buf;
+	struct pcdev_shard *oldest;
+	struct pcdev_shard *shard;
+	struct pcd_shard_rec rec;
+	ssize_t ret;
+	u64 ts;
+	int cpu;
+
+retry:
+	oldest = NULL;
+	ts = U64_MAX;
+	for_each_possible_cpu(cpu) {
+		shard = per_cpu_ptr(priv->shards, cpu);
+		if (READ_ONCE(shard->head) == READ_ONCE(shard->tail))
+			continue;
+		spin_lock(&shard->lock);
+		if (shard->head != shard->tail) {
+			pcd_shard_get(priv, shard, shard->tail, &rec,
+				      sizeof(rec));
+			if (rec.ts < ts) {
+				ts = rec.ts;
+				oldest = shard;
+			}
+		}
+		spin_unlock(&shard->lock);
+	}
+	if (!oldest)
+		return 0;
+
+	spin_lock(&oldest->lock);
+	/* the record may have been dropped to make room meanwhile */
+	if (oldest->head == oldest->tail) {
+		spin_unlock(&oldest->lock);
+		goto retry;
+	}
+	pcd_shard_get(priv, oldest, oldest->tail, &rec, sizeof(rec));
+	if (rec.ts != ts) {
+		spin_unlock(&oldest->lock);
+		goto retry;
+	}
+	if (sizeof(*hdr) + rec.len > room) {
+		ret = -EMSGSIZE;
+	} else {
+		pcd_shard_get(priv, oldest, oldest->tail + sizeof(rec), hdr + 1,
+			      rec.len);
+		pos->shard = oldest;
+		pos->tail = oldest->tail;
+		pos->size = pcd_shard_rec_size(rec.len);
+		pos->dropped = oldest->dropped;
+
+		/* records dropped from this shard were older than this one,
+		 * they leave a gap in 'seq' */
+		hdr->seq = priv->shard_seq + pos->dropped + 1;
+		hdr->ts_ns = rec.ts;
+		hdr->len = rec.len;
+		hdr->flags = 0;
+		ret = sizeof(*hdr) + rec.len;
+	}
+	spin_unlock(&oldest->lock);
+
+	return ret;
+}
+
+/* Consumes the record pcd_shard_peek() copied, once it has been delivered */
+static void pcd_shard_consume(struct pcdev_private_data *priv,
+			      struct pcd_shard_pos *pos)
+{
+	struct pcdev_shard *shard = pos->shard;
+
+	spin_lock(&shard->lock);
+	if (shard->tail == pos->tail) {
+		shard->tail += pos->size;
+		shard->dropped -= pos->dropped;
+	} else {
+		/* a writer dropped it to make room meanwhile, and counted it */
+		shard->dropped -= pos->dropped + 1;
+	}
+	spin_unlock(&shard->lock);
+
+	priv->shard_seq += pos->dropped + 1;
+}
+
+static bool pcd_shards_readable(struct pcdev_private_data *priv)
+{
+	struct pcdev_shard *shard;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		shard = per_cpu_ptr(priv->shards, cpu);
+		if (READ_ONCE(shard->head) != READ_ONCE(shard->tail))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Returns as many whole records as fit, oldest first, each framed like
+ * those of PCD_MODE_RECORD
+ */
+static ssize_t pcd_shard_read(struct pcdev_private_data *priv,
+			      struct kiocb *iocb, struct iov_iter *to)
+{
+	bool nonblock = pcd_nonblock(iocb);
+	struct pcd_shard_pos pos;
+	ssize_t copied = 0;
+	ssize_t len;
+	ssize_t ret;
+	char *buf;
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	buf = kmalloc(sizeof(struct pcd_record) + PCD_SHARD_MAX_RECORD,
+		      GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	if (nonblock) {
+		if (!mutex_trylock(&priv->shard_read_lock)) {
+			ret = -EAGAIN;
+			goto out;
+		}
+	} else if (mutex_lock_interruptible(&priv->shard_read_lock)) {
+		ret = -ERESTARTSYS;
+		goto out;
+	}
+
+	while (!pcd_shards_readable(priv)) {
+		if (nonblock) {
+			ret = -EAGAIN;
+			goto unlock;
+		}
+		ret = wait_event_interruptible(priv->read_wq,
+					       pcd_shards_readable(priv));
+		if (ret)
+			goto unlock;
+	}
+
+	while ((len = pcd_shard_peek(priv, buf, iov_iter_count(to),
+				     &pos)) > 0) {
+		/* a record that could not be delivered stays for the next
+		 * read */
+		if (copy_to_iter(buf, len, to) != len) {
+			len = -EFAULT;
+			break;
+		}
+		pcd_shard_consume(priv, &pos);
+		copied += len;
+	}
+	ret = copied ? copied : len;
+
+unlock:
+	mutex_unlock(&priv->shard_read_lock);
+out:
+	kfree(buf);
+	return ret;
+}
+
+/* Appends one record, at most PCD_SHARD_MAX_RECORD bytes of the write */
+static ssize_t pcd_shard_write(struct pcdev_private_data *priv,
+			       struct kiocb *iocb, struct iov_iter *from)
+{
+	size_t len = min_t(size_t, iov_iter_count(from), PCD_SHARD_MAX_RECORD);
+	char stack_buf[PCD_SHARD_STACK_RECORD];
+	char *buf = stack_buf;
+	ssize_t ret = len;
+
+	if (!len)
+		return 0;
+
+	/* copying from user space may fault, so it is done before the
+	 * shard is taken */
+	if (len > sizeof(stack_buf)) {
+		buf = kmalloc(len, (iocb->ki_flags & IOCB_NOWAIT) ?
+			      GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL);
+		if (!buf)
+			return (iocb->ki_flags & IOCB_NOWAIT) ? -EAGAIN :
+								-ENOMEM;
+	}
+
+	if (copy_from_iter(buf, len, from) != len) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	pcd_shard_push(priv, buf, len);
+	pcd_relay_write(priv, -1, buf, len);
+
+	/* only look at the shared wait queue, never write to it, unless a
+	 * reader sleeps */
+	if (wq_has_sleeper(&priv->read_wq))
+		wake_up_interruptible(&priv->read_wq);
+
+out:
+	if (buf != stack_buf)
+		kfree(buf);
+	return ret;
+}
+
+/*
+ * PCD_MODE_RECORD: every write() is one record stamped with a sequence
+ * number and the monotonic time, stored on the kernel ring_buffer. Writers
+ * do not wait for each other: the ring buffer is per-CPU and lockless, and
+ * overwrites the oldest records when it is full. Readers merge the per-CPU
+ * buffers by sequence number and are told when records were lost, like
+ * with /dev/kmsg.
+ */
+
+/* Stamps a reserved record and hands it to the readers */
+static void pcd_rec_commit(struct pcdev_private_data *priv,
+			   struct ring_buffer_event *event, size_t len)
+{
+	struct pcd_record *rec = ring_buffer_event_data(event);
+
+	/* taken last, with preemption disabled, so that the records of each
+	 * CPU are in 'seq' order and their times follow it */
+	rec->seq = atomic64_inc_return(&priv->rec_seq);
+	rec->ts_ns = ktime_get_ns();
+	rec->len = len;
+	rec->flags = 0;
+	pcd_relay_write(priv, -1, (const char *)(rec + 1), len);
+	ring_buffer_unlock_commit(priv->records, event);
+}
+
+static ssize_t pcd_rec_write(struct pcdev_private_data *priv,
+			     struct kiocb *iocb, struct iov_iter *from)
+{
+	size_t len = iov_iter_count(from);
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	struct ring_buffer_event *event;
+	size_t copied;
+	char *buf;
+
+	/* a record is written whole or not at all */
+	if (len > PCD_RECORD_MAX)
+		return -EMSGSIZE;
+
+	/* the ring buffer does not allow faults while a record is reserved,
+	 * so data is only copied straight in if it is resident */
+	event = ring_buffer_lock_reserve(priv->records,
+					 sizeof(struct pcd_record) + len);
+	if (!event)
+		return -ENOSPC;
+	pagefault_disable();
+	copied = copy_from_iter((struct pcd_record *)
+				ring_buffer_event_data(event) + 1, len, from);
+	pagefault_enable();
+	if (copied == len) {
+		pcd_rec_commit(priv, event, len);
+		goto wake;
+	}
+	ring_buffer_discard_commit(priv->records, event);
+	iov_iter_revert(from, copied);
+
+	/* otherwise it is staged first, where it may fault in */
+	buf = kmalloc(len, nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL);
+	if (!buf)
+		return nowait ? -EAGAIN : -ENOMEM;
+	if (copy_from_iter(buf, len, from) != len) {
+		kfree(buf);
+		return -EFAULT;
+	}
+	event = ring_buffer_lock_reserve(priv->records,
+					 sizeof(struct pcd_record) + len);
+	if (!event) {
+		kfree(buf);
+		return -ENOSPC;
+	}
+	memcpy((struct pcd_record *)ring_buffer_event_data(event) + 1, buf,
+	       len);
+	pcd_rec_commit(priv, event, len);
+	kfree(buf);
+
+wake:
+	if (wq_has_sleeper(&priv->read_wq))
+		wake_up_interruptible(&priv->read_wq);
+
+	return len;
+}
+
+/*
+ * CPU whose oldest record is the oldest of all, -1 if there is none. The
+ * buffers of CPUs gone offline keep their records, so all possible CPUs are
+ * looked at, as ring_buffer_empty() does. The time stamps of two CPUs may
+ * disagree with the order their records were numbered in, so records are
+ * merged by 'seq'.
+ */
+static int pcd_rec_oldest(struct pcdev_private_data *priv)
+{
+	struct ring_buffer_event *event;
+	struct pcd_record *rec;
+	unsigned long lost;
+	u64 seq = U64_MAX;
+	u64 rb_ts;
+	int oldest = -1;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (ring_buffer_empty_cpu(priv->records, cpu))
+			continue;
+		event = ring_buffer_peek(priv->records, cpu, &rb_ts, &lost);
+		if (!event)
+			continue;
+		rec = ring_buffer_event_data(event);
+		if (rec->seq < seq) {
+			seq = rec->seq;
+			oldest = cpu;
+		}
+	}
+
+	return oldest;
+}
+
+/* Moves the oldest record to 'rec_pending', noting overwritten ones */
+static bool pcd_rec_next(struct pcdev_private_data *priv)
+{
+	struct ring_buffer_event *event;
+	struct pcd_record *rec;
+	unsigned long lost;
+	u64 rb_ts;
+	int cpu;
+
+	while ((cpu = pcd_rec_oldest(priv)) >= 0) {
+		event = ring_buffer_consume(priv->records, cpu, &rb_ts, &lost);
+		if (!event)
+			continue;
+		rec = ring_buffer_event_data(event);
+		priv->rec_pending_len = sizeof(*rec) + rec->len;
+		memcpy(priv->rec_pending, rec, priv->rec_pending_len);
+		if (lost)
+			priv->rec_lost = true;
+		return true;
+	}
+
+	return false;
+}
+
+static bool pcd_rec_readable(struct pcdev_private_data *priv)
+{
+	return priv->rec_pending_len || priv->rec_lost ||
+	       !ring_buffer_empty(priv->records);
+}
+
+/* Returns as many whole records as fit, oldest first */
+static ssize_t pcd_rec_read(struct pcdev_private_data *priv,
+			    struct kiocb *iocb, struct iov_iter *to)
+{
+	bool nonblock = pcd_nonblock(iocb);
+	ssize_t copied = 0;
+	ssize_t ret = 0;
+
+	if (nonblock) {
+		if (!mutex_trylock(&priv->rec_read_lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&priv->rec_read_lock)) {
+		return -ERESTARTSYS;
+	}
+
+	while (!pcd_rec_readable(priv)) {
+		if (nonblock) {
+			ret = -EAGAIN;
+			goto unlock;
+		}
+		ret = wait_event_interruptible(priv->read_wq,
+					       pcd_rec_readable(priv));
+		if (ret)
+			goto unlock;
+	}
+
+	for (;;) {
+		if (!priv->rec_pending_len && !pcd_rec_next(priv))
+			break;
+		/* the loss is reported before the records that follow it */
+		if (priv->rec_lost) {
+			if (!copied) {
+				priv->rec_lost = false;
+				ret = -EPIPE;
+			}
+			break;
+		}
+		if (priv->rec_pending_len > iov_iter_count(to)) {
+			if (!copied)
+				ret = -EMSGSIZE;
+			break;
+		}
+		if (copy_to_iter(priv->rec_pending, priv->rec_pending_len,
+				 to) != priv->rec_pending_len) {
+			if (!copied)
+				ret = -EFAULT;
+			break;
+		}
+		copied += priv->rec_pending_len;
+		priv->rec_pending_len = 0;
+	}
+	if (copied)
+		ret = copied;
+
+unlock:
+	mutex_unlock(&priv->rec_read_lock);
+	return ret;
+}
+
+/* The per-CPU buffers hold 'size' bytes of records between them */
+static int pcd_rec_alloc(struct pcdev_private_data *priv, loff_t size)
+{
+	unsigned long per_cpu = max_t(unsigned long,
+				      size / num_possible_cpus(),
+				      2 * PAGE_SIZE);
+
+	priv->rec_pending = kmalloc_node(sizeof(struct pcd_record) +
+					 PCD_RECORD_MAX, GFP_KERNEL,
+					 priv->node);
+	if (!priv->rec_pending)
+		return -ENOMEM;
+
+	priv->records = ring_buffer_alloc(per_cpu, RB_FL_OVERWRITE);
+	if (!priv->records) {
+		kfree(priv->rec_pending);
+		priv->rec_pending = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void pcd_rec_free(struct pcdev_private_data *priv)
+{
+	if (priv->records)
+		ring_buffer_free(priv->records);
+	kfree(priv->rec_pending);
+}
+
+/* Gives every possible CPU a shard, on its own node */
+static int pcd_shards_alloc(struct pcdev_private_data *priv)
+{
+	struct pcdev_shard *shard;
+	size_t size;
+	int cpu;
+
+	/* each CPU gets its part of the buffer, at least two pages */
+	size = max_t(loff_t, priv->pdata.size / num_possible_cpus(),
+		     2 * PAGE_SIZE);
+	size = rounddown_pow_of_two(min_t(size_t, size, PCD_MAX_RING));
+	priv->shard_mask = size - 1;
+
+	priv->shards = alloc_percpu(struct pcdev_shard);
+	if (!priv->shards)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		shard = per_cpu_ptr(priv->shards, cpu);
+		spin_lock_init(&shard->lock);
+		shard->buf = kvmalloc_node(size, GFP_KERNEL, cpu_to_node(cpu));
+		if (!shard->buf)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void pcd_shards_free(struct pcdev_private_data *priv)
+{
+	int cpu;
+
+	if (!priv->shards)
+		return;
+
+	for_each_possible_cpu(cpu)
+		kvfree(per_cpu_ptr(priv->shards, cpu)->buf);
+	free_percpu(priv->shards);
+	priv->shards = NULL;
+}
+
+int pcd_open(struct inode *inode, struct file *filp)
+{
+	int ret;
+	int minor_n;
+	struct pcdev_private_data *priv;
+	u64 start = pcd_lat_start();
+
+	/* find out on which device file open was attempted by the user space */
+	minor_n = MINOR(inode->i_rdev);
+	pr_debug("Minor access = %d\n", minor_n);
+
+	/* gets device's private data structure */
+	priv = container_of(inode->i_cdev, struct pcdev_private_data, cdev);
+	/* a stale inode may still lead to a removed device */
+	if (READ_ONCE(priv->removed))
+		return -ENODEV;
+	/* supply device private data to other methods of the driver */
+	filp->private_data = priv;
+	/* read and write honour IOCB_NOWAIT, so RWF_NOWAIT and io_uring may be
+	 * used. Threads sharing this file serialize their updates of f_pos. */
+	filp->f_mode |= FMODE_NOWAIT | FMODE_ATOMIC_POS;
+
+	/* an open file keeps the shrinker away; wait for it if it is
+	 * already at work, pairs with the barrier in pcd_reclaim() */
+	if (priv->pdata.reclaim != PCD_RECLAIM_NONE) {
+		atomic_inc(&priv->nr_open);
+		smp_mb__after_atomic();
+		if (unlikely(READ_ONCE(priv->reclaiming)))
+			wait_event(priv->reclaim_wq,
+				   !READ_ONCE(priv->reclaiming));
+	}
+
+	/* check permission */
+	ret = check_permission(priv->pdata.perm, filp->f_mode);
+	if (ret) {
+		pcd_stats_inc(priv, PCD_STAT_EPERM);
+		pr_debug("Open unsuccesful\n");
+	} else if (priv->pdata.mode == PCD_MODE_SPSC) {
+		/* a ring has no file position: no lseek, pread or pwrite */
+		stream_open(inode, filp);
+		ret = pcd_ring_claim(&priv->ring, filp->f_mode);
+		if (ret)
+			pr_debug("Ring side already taken\n");
+	} else if (priv->pdata.mode == PCD_MODE_SHARDED ||
+		   priv->pdata.mode == PCD_MODE_RECORD) {
+		/* records are consumed in order, there is no position */
+		stream_open(inode, filp);
+	}
+	else {
+		pr_debug("Open was successful\n");
+	}
+
+	if (ret && priv->pdata.reclaim != PCD_RECLAIM_NONE)
+		atomic_dec(&priv->nr_open);
+
+	pcd_lat_end(priv, PCD_LAT_OPEN, 0, start);
+	trace_pcd_open(priv->id, minor_n, filp->f_mode, ret);
+	return ret;
+}
+
+int pcd_release(struct inode *inode, struct file *flip)
+{
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)flip->private_data;
+
+	if (priv->pdata.mode == PCD_MODE_SPSC)
+		pcd_ring_unclaim(&priv->ring, flip->f_mode);
+	if (priv->pdata.reclaim != PCD_RECLAIM_NONE)
+		atomic_dec(&priv->nr_open);
+
+	trace_pcd_release(priv->id);
+	pr_debug("Release was succesful\n");
+	return 0;
+}
+
+/* Reads a flat device at 'pos'; holes read as zeros */
+static ssize_t pcd_flat_read(struct pcdev_private_data *priv, loff_t pos,
+			     struct iov_iter *to)
+{
+	loff_t max_size = priv->pdata.size;
+	size_t count = iov_iter_count(to);
+	size_t copied;
+	unsigned int seq;
+	int ret;
+
+	/* Nothing left to read at or beyond the end of the device */
+	if (pos >= max_size)
+		return 0;
+
+	/* Adjust the 'count' */
+	count = pcd_clamp_count(pos, count, max_size);
+
+	/* Pages given back under memory pressure are read back first */
+	ret = pcd_reload(priv, pos, count);
+	if (ret)
+		return ret;
+
+	/* copy to user, possibly into several user buffers at once. Readers
+	 * never block each other: if a writer changed the buffer while we were
+	 * copying, the copy is simply done again. */
+	do {
+		seq = read_seqbegin(&priv->lock);
+		copied = pcd_copy_to_iter(&priv->pages, pos, count, to);
+		if (!read_seqretry(&priv->lock, seq))
+			break;
+		iov_iter_revert(to, copied);
+	} while (1);
+
+	if (count && !copied)
+		return -EFAULT;
+
+	/* return the number of bytes which have been succesfully read */
+	return copied;
+}
+
+/* Writes a flat device at 'pos', without sleeping if 'nowait' is set */
+static ssize_t pcd_flat_write(struct pcdev_private_data *priv, loff_t pos,
+			      struct iov_iter *from, bool nowait)
+{
+	loff_t max_size = priv->pdata.size;
+	size_t count = iov_iter_count(from);
+	size_t copied;
+	char *kbuf;
+	int ret;
+
+	if (!count)
+		return 0;
+
+	/* Adjust the 'count' */
+	count = pcd_clamp_count(pos, count, max_size);
+
+	/* Very large writes are split, so that staging them stays cheap. One
+	 * that may not sleep only gets what an order-0 allocation can take,
+	 * a larger one would fail as soon as memory is fragmented. */
+	count = min_t(size_t, count,
+		      nowait ? PCD_MAX_NOWAIT_WRITE : PCD_MAX_WRITE);
+
+	if(!count)
+	{
+		pr_debug("No space left on the device!\n");
+		return -ENOMEM;
+	}
+
+	/* copy from user, possibly from several user buffers at once. The data
+	 * is staged first, since copying from user space may fault and sleep,
+	 * so that the buffer is only held for a memcpy(). */
+	kbuf = kvmalloc(count,
+			nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL);
+	if (!kbuf)
+		return nowait ? -EAGAIN : -ENOMEM;
+
+	copied = copy_from_iter(kbuf, count, from);
+	if (!copied) {
+		kvfree(kbuf);
+		return -EFAULT;
+	}
+
+	/* No snapshot may start sharing the pages until they are written */
+	if (nowait) {
+		if (!down_read_trylock(&priv->snap_rwsem)) {
+			kvfree(kbuf);
+			return -EAGAIN;
+		}
+	} else {
+		down_read(&priv->snap_rwsem);
+	}
+
+	/* Fill the holes being written to before taking the lock */
+	ret = pcd_populate(priv, pos, copied,
+			   nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL);
+	if (ret) {
+		up_read(&priv->snap_rwsem);
+		kvfree(kbuf);
+		return nowait ? -EAGAIN : ret;
+	}
+
+	write_seqlock(&priv->lock);
+	pcd_copy_to_pages(priv, pos, kbuf, copied);
+	write_sequnlock(&priv->lock);
+	up_read(&priv->snap_rwsem);
+	pcd_relay_write(priv, pos, kbuf, copied);
+	kvfree(kbuf);
+
+	pcd_mark_dirty(priv, pos, copied);
+
+	/* return the number of bytes which have been succesfully writen */
+	return copied;
+}
+
+ssize_t pcd_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+	loff_t pos = iocb->ki_pos;
+	size_t requested = iov_iter_count(to);
+	u64 start = pcd_lat_start();
+	ssize_t ret;
+
+	pr_debug("Read requested for %zu bytes\n", requested);
+	pr_debug("Current file position = %lld\n", pos);
+
+	if (priv->pdata.mode == PCD_MODE_SPSC)
+		ret = pcd_spsc_read(priv, iocb, to);
+	else if (priv->pdata.mode == PCD_MODE_SHARDED)
+		ret = pcd_shard_read(priv, iocb, to);
+	else if (priv->pdata.mode == PCD_MODE_RECORD)
+		ret = pcd_rec_read(priv, iocb, to);
+	else
+		ret = pcd_flat_read(priv, pos, to);
+
+	/* update the current file position */
+	if (ret > 0)
+		iocb->ki_pos += ret;
+	pr_debug("Number of bytes succesfully read = %zd\n", ret);
+	pr_debug("Updated file position = %lld\n", iocb->ki_pos);
+
+	pcd_stats_rw(priv, false, requested, ret);
+	pcd_lat_end(priv, PCD_LAT_READ, requested, start);
+	trace_pcd_read(priv->id, pos, requested, ret);
+	return ret;
+}
+
+ssize_t pcd_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+	loff_t pos = iocb->ki_pos;
+	size_t requested = iov_iter_count(from);
+	u64 start = pcd_lat_start();
+	ssize_t ret;
+
+	pr_debug("Write requested for %zu bytes \n", requested);
+	pr_debug("Current file position = %lld\n", pos);
+
+	if (priv->pdata.mode == PCD_MODE_SPSC)
+		ret = pcd_spsc_write(priv, iocb, from);
+	else if (priv->pdata.mode == PCD_MODE_SHARDED)
+		ret = pcd_shard_write(priv, iocb, from);
+	else if (priv->pdata.mode == PCD_MODE_RECORD)
+		ret = pcd_rec_write(priv, iocb, from);
+	else
+		ret = pcd_flat_write(priv, pos, from,
+				     iocb->ki_flags & IOCB_NOWAIT);
+
+	/* update the current file position */
+	if (ret > 0)
+		iocb->ki_pos += ret;
+	pr_debug("Number of bytes written successfully = %zd\n", ret);
+	pr_debug("Updated file position = %lld\n", iocb->ki_pos);
+
+	pcd_stats_rw(priv, true, requested, ret);
+	pcd_lat_end(priv, PCD_LAT_WRITE, requested, start);
+	trace_pcd_write(priv->id, pos, requested, ret);
+	return ret;
+}
+
+/* Runs one descriptor of a PCD_IOC_SG batch */
+static ssize_t pcd_sg_one(struct file *filp, struct pcdev_private_data *priv,
+			  struct pcd_sg_desc *desc)
+{
+	struct iovec iov;
+	struct iov_iter iter;
+	bool write = (desc->dir == PCD_SG_WRITE);
+	ssize_t ret;
+
+	if (desc->dir != PCD_SG_READ && desc->dir != PCD_SG_WRITE)
+		return -EINVAL;
+
+	/* the same checks as open() does for the whole file */
+	if (!(filp->f_mode & (write ? FMODE_WRITE : FMODE_READ)) ||
+	    (priv->pdata.perm == (write ? RDONLY : WRONLY))) {
+		pcd_stats_inc(priv, PCD_STAT_EPERM);
+		return -EPERM;
+	}
+
+	if (desc->offset > priv->pdata.size)
+		return -EINVAL;
+
+	ret = import_single_range(write ? WRITE : READ,
+				  u64_to_user_ptr(desc->addr), desc->len,
+				  &iov, &iter);
+	if (ret)
+		return ret;
+
+	if (write)
+		ret = pcd_flat_write(priv, desc->offset, &iter, false);
+	else
+		ret = pcd_flat_read(priv, desc->offset, &iter);
+
+	pcd_stats_rw(priv, write, desc->len, ret);
+	if (write)
+		trace_pcd_write(priv->id, desc->offset, desc->len, ret);
+	else
+		trace_pcd_read(priv->id, desc->offset, desc->len, ret);
+
+	return ret;
+}
+
+/*
+ * Runs a batch of reads and writes at explicit offsets in one call. The
+ * result of each descriptor is stored in its 'result' field; the call itself
+ * only fails if the batch can not be accessed.
+ */
+static long pcd_ioctl_sg(struct file *filp, struct pcdev_private_data *priv,
+			 struct pcd_sg_batch __user *ubatch)
+{
+	struct pcd_sg_batch batch;
+	struct pcd_sg_desc __user *udescs;
+	struct pcd_sg_desc desc;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.flags || batch.count > PCD_SG_MAX)
+		return -EINVAL;
+
+	/* only a flat device can be addressed by offset */
+	if (priv->pdata.mode != PCD_MODE_FLAT)
+		return -EINVAL;
+
+	udescs = u64_to_user_ptr(batch.descs);
+	for (i = 0; i < batch.count; i++) {
+		if (copy_from_user(&desc, &udescs[i], sizeof(desc)))
+			return -EFAULT;
+
+		desc.result = pcd_sg_one(filp, priv, &desc);
+
+		if (put_user(desc.result, &udescs[i].result))
+			return -EFAULT;
+	}
+
+	return 0;
+}
+
+/* Creates the companion node "pcdev-<id>-snap" the snapshots are read from */
+static int pcd_snap_node(struct pcdev_private_data *priv)
+{
+	struct pcdrv_private_data *drv_priv = &pcdrv_private_data;
+	int ret;
+
+	if (priv->snap_device)
+		return 0;
+	if (priv->removed)
+		return -ENODEV;
+
+	ret = ida_alloc_max(&pcd_minor_ida, MAX_DEVICES - 1, GFP_KERNEL);
+	if (ret < 0)
+		return ret;
+	priv->snap_num = MKDEV(MAJOR(drv_priv->device_num_base), ret);
+
+	cdev_init(&priv->snap_cdev, &pcd_snap_fops);
+	priv->snap_cdev.owner = THIS_MODULE;
+	cdev_set_parent(&priv->snap_cdev, &priv->kobj);
+	ret = cdev_add(&priv->snap_cdev, priv->snap_num, 1);
+	if (ret < 0)
+		goto free_minor;
+
+	priv->snap_device = device_create(drv_priv->class_pcd, NULL,
+					  priv->snap_num, priv,
+					  "pcdev-%d-snap", priv->id);
+	if (IS_ERR(priv->snap_device)) {
+		ret = PTR_ERR(priv->snap_device);
+		priv->snap_device = NULL;
+		goto cdev_del;
+	}
+
+	return 0;
+
+cdev_del:
+	cdev_del(&priv->snap_cdev);
+free_minor:
+	ida_free(&pcd_minor_ida, MINOR(priv->snap_num));
+	return ret;
+}
+
+/*
+ * Takes a snapshot of a flat device, replacing the previous one; files
+ * already open on the companion node keep reading the one they opened.
+ * Nothing is copied: the snapshot takes a reference on every page and the
+ * device copies a page before it next writes it. Mapped and exported
+ * devices are refused, since their pages can be written without the driver
+ * noticing.
+ */
+static long pcd_snapshot(struct file *filp, struct pcdev_private_data *priv)
+{
+	struct pcdev_snapshot *snap;
+	struct pcdev_snapshot *old;
+	struct page *page;
+	unsigned long index;
+	int ret;
+
+	/* the snapshot node is readable, so only a reader may fill it */
+	if (!(filp->f_mode & FMODE_READ) || (priv->pdata.perm == WRONLY)) {
+		pcd_stats_inc(priv, PCD_STAT_EPERM);
+		return -EPERM;
+	}
+
+	if (priv->pdata.mode != PCD_MODE_FLAT)
+		return -EINVAL;
+
+	/* the snapshot only shares the pages that are present */
+	ret = pcd_reload(priv, 0, priv->pdata.size);
+	if (ret)
+		return ret;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+	kref_init(&snap->ref);
+	snap->size = priv->pdata.size;
+	xa_init(&snap->pages);
+
+	mutex_lock(&priv->snap_lock);
+	ret = pcd_snap_node(priv);
+	if (ret)
+		goto unlock;
+
+	down_write(&priv->snap_rwsem);
+	if (atomic_read(&priv->nr_mappings)) {
+		ret = -EBUSY;
+		goto unlock_pages;
+	}
+	xa_for_each(&priv->pages, index, page) {
+		ret = xa_err(xa_store(&snap->pages, index, page, GFP_KERNEL));
+		if (ret)
+			goto unlock_pages;
+		get_page(page);
+		xa_set_mark(&priv->pages, index, PCD_PAGE_SHARED);
+	}
+	up_write(&priv->snap_rwsem);
+
+	old = priv->snap;
+	priv->snap = snap;
+	mutex_unlock(&priv->snap_lock);
+
+	if (old)
+		kref_put(&old->ref, pcd_snap_free);
+	return 0;
+
+unlock_pages:
+	up_write(&priv->snap_rwsem);
+unlock:
+	mutex_unlock(&priv->snap_lock);
+	kref_put(&snap->ref, pcd_snap_free);
+	return ret;
+}
+
+/*
+ * dma-buf export of a flat device. The export holds a reference on every
+ * page of the device, which importers map for DMA, mmap or vmap; it counts
+ * as a mapping of the device, so that no snapshot can swap the pages from
+ * under it, and holds a reference on the device, which it may outlive.
+ */
+struct pcd_dmabuf {
+	struct pcdev_private_data *priv;
+	struct page **pages;
+	unsigned int nr_pages;
+	/* importers may write, as the exporting file could */
+	bool rdwr;
+};
+
+static struct sg_table *pcd_dmabuf_map(struct dma_buf_attachment *attach,
+				       enum dma_data_direction dir)
+{
+	struct pcd_dmabuf *exp = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	/* a device may only read from a read-only export */
+	if (!exp->rdwr && dir != DMA_TO_DEVICE)
+		return ERR_PTR(-EPERM);
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = sg_alloc_table_from_pages(sgt, exp->pages, exp->nr_pages, 0,
+					(size_t)exp->nr_pages << PAGE_SHIFT,
+					GFP_KERNEL);
+	if (ret)
+		goto free_sgt;
+
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (ret)
+		goto free_table;
+
+	return sgt;
+
+free_table:
+	sg_free_table(sgt);
+free_sgt:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void pcd_dmabuf_unmap(struct dma_buf_attachment *attach,
+			     struct sg_table *sgt, enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static int pcd_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct pcd_dmabuf *exp = dmabuf->priv;
+
+	/* also reached through dma_buf_mmap(), which does not look at the
+	 * mode of the dma-buf file */
+	if (!exp->rdwr) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	return vm_map_pages(vma, exp->pages, exp->nr_pages);
+}
+
+static int pcd_dmabuf_vmap(struct dma_buf *dmabuf, struct dma_buf_map *map)
+{
+	struct pcd_dmabuf *exp = dmabuf->priv;
+	void *vaddr;
+
+	vaddr = vmap(exp->pages, exp->nr_pages, VM_MAP,
+		     exp->rdwr ? PAGE_KERNEL : PAGE_KERNEL_RO);
+	if (!vaddr)
+		return -ENOMEM;
+
+	dma_buf_map_set_vaddr(map, vaddr);
+	return 0;
+}
+
+static void pcd_dmabuf_vunmap(struct dma_buf *dmabuf, struct dma_buf_map *map)
+{
+	vunmap(map->vaddr);
+}
+
+static void pcd_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct pcd_dmabuf *exp = dmabuf->priv;
+	unsigned int i;
+
+	/* importer stores are not tracked, see pcd_mark_all_dirty() */
+	if (exp->rdwr)
+		pcd_mark_all_dirty(exp->priv);
+	for (i = 0; i < exp->nr_pages; i++)
+		put_page(exp->pages[i]);
+	atomic_dec(&exp->priv->nr_mappings);
+	kobject_put(&exp->priv->kobj);
+	kvfree(exp->pages);
+	kfree(exp);
+}
+
+static const struct dma_buf_ops pcd_dmabuf_ops = {
+	.map_dma_buf = pcd_dmabuf_map,
+	.unmap_dma_buf = pcd_dmabuf_unmap,
+	.mmap = pcd_dmabuf_mmap,
+	.vmap = pcd_dmabuf_vmap,
+	.vunmap = pcd_dmabuf_vunmap,
+	.release = pcd_dmabuf_release,
+};
+
+/* Returns a new dma-buf fd sharing every page of the device */
+static long pcd_ioctl_export(struct file *filp,
+			     struct pcdev_private_data *priv,
+			     struct pcd_export __user *uexp)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct pcd_export args;
+	struct pcd_dmabuf *exp;
+	struct dma_buf *dmabuf;
+	bool rdwr;
+	unsigned int i;
+	int ret;
+
+	if (copy_from_user(&args, uexp, sizeof(args)))
+		return -EFAULT;
+	if (args.flags & ~(PCD_EXPORT_RDWR | PCD_EXPORT_CLOEXEC))
+		return -EINVAL;
+
+	/* only a flat device has a fixed layout to share */
+	if (priv->pdata.mode != PCD_MODE_FLAT)
+		return -EINVAL;
+
+	/* importers get at most the access this file has */
+	rdwr = args.flags & PCD_EXPORT_RDWR;
+	if (!(filp->f_mode & FMODE_READ) ||
+	    (rdwr && !(filp->f_mode & FMODE_WRITE))) {
+		pcd_stats_inc(priv, PCD_STAT_EPERM);
+		return -EPERM;
+	}
+
+	/* every page is allocated and pinned, however sparse the device */
+	if (priv->pdata.size > PCD_EXPORT_MAX)
+		return -EFBIG;
+
+	exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+	if (!exp)
+		return -ENOMEM;
+	exp->priv = priv;
+	exp->rdwr = rdwr;
+	exp->nr_pages = DIV_ROUND_UP(priv->pdata.size, PAGE_SIZE);
+	exp->pages = kvmalloc_array(exp->nr_pages, sizeof(*exp->pages),
+				    GFP_KERNEL);
+	if (!exp->pages) {
+		ret = -ENOMEM;
+		goto free_exp;
+	}
+
+	/* Give every page a private copy now, and count the export as a
+	 * mapping before a snapshot may share them again */
+	down_read(&priv->snap_rwsem);
+	ret = pcd_populate(priv, 0, priv->pdata.size, GFP_KERNEL);
+	if (ret) {
+		up_read(&priv->snap_rwsem);
+		goto free_pages;
+	}
+	for (i = 0; i < exp->nr_pages; i++) {
+		exp->pages[i] = xa_load(&priv->pages, i);
+		get_page(exp->pages[i]);
+	}
+	atomic_inc(&priv->nr_mappings);
+	kobject_get(&priv->kobj);
+	up_read(&priv->snap_rwsem);
+
+	exp_info.ops = &pcd_dmabuf_ops;
+	exp_info.size = (size_t)exp->nr_pages << PAGE_SHIFT;
+	exp_info.flags = rdwr ? O_RDWR : O_RDONLY;
+	exp_info.priv = exp;
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		ret = PTR_ERR(dmabuf);
+		goto put_pages;
+	}
+
+	/* from here on, dma_buf_put() releases everything */
+	ret = dma_buf_fd(dmabuf, (args.flags & PCD_EXPORT_CLOEXEC) ?
+			 O_CLOEXEC : 0);
+	if (ret < 0) {
+		dma_buf_put(dmabuf);
+		return ret;
+	}
+
+	/* the fd is already installed, so it can not be taken back */
+	if (put_user(ret, &uexp->fd))
+		return -EFAULT;
+	return 0;
+
+put_pages:
+	for (i = 0; i < exp->nr_pages; i++)
+		put_page(exp->pages[i]);
+	atomic_dec(&priv->nr_mappings);
+	kobject_put(&priv->kobj);
+free_pages:
+	kvfree(exp->pages);
+free_exp:
+	kfree(exp);
+	return ret;
+}
+
+long pcd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)filp->private_data;
+
+	switch (cmd) {
+	case PCD_IOC_SG:
+		return pcd_ioctl_sg(filp, priv, (void __user *)arg);
+	case PCD_IOC_SNAPSHOT:
+		return pcd_snapshot(filp, priv);
+	case PCD_IOC_EXPORT:
+		return pcd_ioctl_export(filp, priv, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+int pcd_snap_open(struct inode *inode, struct file *filp)
+{
+	struct pcdev_private_data *priv = container_of(inode->i_cdev,
+					struct pcdev_private_data, snap_cdev);
+	struct pcdev_snapshot *snap;
+
+	/* a snapshot never changes */
+	if (filp->f_mode & FMODE_WRITE)
+		return -EPERM;
+
+	mutex_lock(&priv->snap_lock);
+	snap = priv->snap;
+	if (snap)
+		kref_get(&snap->ref);
+	mutex_unlock(&priv->snap_lock);
+
+	if (!snap)
+		return -ENODEV;
+
+	filp->private_data = snap;
+	return 0;
+}
+
+int pcd_snap_release(struct inode *inode, struct file *filp)
+{
+	struct pcdev_snapshot *snap = filp->private_data;
+
+	kref_put(&snap->ref, pcd_snap_free);
+	return 0;
+}
+
+ssize_t pcd_snap_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct pcdev_snapshot *snap = iocb->ki_filp->private_data;
+	size_t count;
+	size_t copied;
+
+	count = pcd_clamp_count(iocb->ki_pos, iov_iter_count(to), snap->size);
+	if (!count)
+		return 0;
+
+	/* no lock needed, nothing writes to a snapshot */
+	copied = pcd_copy_to_iter(&snap->pages, iocb->ki_pos, count, to);
+	if (!copied)
+		return -EFAULT;
+
+	iocb->ki_pos += copied;
+	return copied;
+}
+
+loff_t pcd_snap_lseek(struct file *filp, loff_t off, int whence)
+{
+	struct pcdev_snapshot *snap = filp->private_data;
+
+	return fixed_size_llseek(filp, off, whence, snap->size);
+}
+
+/*
+ * Writes back every dirty page, whatever the range, and syncs the backing
+ * file. Reports a failed background write-back once.
+ */
+int pcd_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)filp->private_data;
+	int ret;
+	int err;
+
+	/* a device without a backing file has nothing to make durable */
+	if (!priv->backing)
+		return 0;
+
+	ret = pcd_writeback(priv);
+
+	mutex_lock(&priv->wb_lock);
+	err = priv->wb_err;
+	priv->wb_err = 0;
+	mutex_unlock(&priv->wb_lock);
+
+	if (ret)
+		return ret;
+	if (err)
+		return err;
+
+	return vfs_fsync(priv->backing, datasync);
+}
+
+/* Offset of the first byte at or after 'off' that is (or is not) backed by a
+ * page, 'max_size' if there is none. */
+static loff_t pcd_seek_data(struct pcdev_private_data *priv, loff_t off,
+			    loff_t max_size, bool data)
+{
+	unsigned long index = off >> PAGE_SHIFT;
+	unsigned long last = (max_size - 1) >> PAGE_SHIFT;
+
+	if (data) {
+		if (!xa_find(&priv->pages, &index, last, XA_PRESENT))
+			index = last + 1;
+		/* pages the shrinker dropped still hold data */
+		if (priv->evicted)
+			index = min(index, find_next_bit(priv->evicted,
+					last + 1, off >> PAGE_SHIFT));
+		if (index > last)
+			return max_size;
+	} else {
+		while ((index <= last) && (xa_load(&priv->pages, index) ||
+		       (priv->evicted && test_bit(index, priv->evicted))))
+			index++;
+	}
+
+	return min_t(loff_t, max_t(loff_t, off, (loff_t)index << PAGE_SHIFT),
+		     max_size);
+}
+
+loff_t pcd_lseek(struct file *filp, loff_t off, int whence)
+{
+	loff_t temp;
+	loff_t ret;
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)filp->private_data;
+	loff_t max_size = priv->pdata.size;
+	u64 start = pcd_lat_start();
+
+	pr_debug("lseek requested\n");
+	pr_debug("Current file position = %lld\n", filp->f_pos);
+
+	/* neither a ring nor shards have a position to seek to */
+	if (priv->pdata.mode != PCD_MODE_FLAT) {
+		ret = -ESPIPE;
+		goto out;
+	}
+
+	switch(whence)
+	{
+		case SEEK_SET:
+			temp = pcd_seek_pos(0, off, max_size);
+			break;
+		case SEEK_CUR:
+			temp = pcd_seek_pos(filp->f_pos, off, max_size);
+			break;
+		case SEEK_END:
+			temp = pcd_seek_pos(max_size, off, max_size);
+			break;
+		case SEEK_DATA:
+		case SEEK_HOLE:
+			/* there is neither data nor a hole past the end */
+			if ((off >= max_size) || (off < 0)) {
+				ret = -ENXIO;
+				goto out;
+			}
+			temp = pcd_seek_data(priv, off, max_size,
+					     whence == SEEK_DATA);
+			if (temp == max_size && whence == SEEK_DATA) {
+				ret = -ENXIO;
+				goto out;
+			}
+			break;
+		default:
+			ret = -EINVAL;
+			goto out;
+	}
+
+	if (temp < 0) {
+		ret = temp;
+		goto out;
+	}
+	filp->f_pos = temp;
+
+	pr_debug("New value of file pointer = %lld\n", filp->f_pos);
+	ret = filp->f_pos;
+out:
+	pcd_lat_end(priv, PCD_LAT_LSEEK, 0, start);
+	trace_pcd_lseek(priv->id, off, whence, ret);
+	return ret;
+}
+
+/* Maps the device page backing the faulting address, filling holes */
+static vm_fault_t pcd_vm_fault(struct vm_fault *vmf)
+{
+	struct pcdev_private_data *priv = vmf->vma->vm_private_data;
+	struct page *page;
+
+	if (vmf->pgoff >= DIV_ROUND_UP(priv->pdata.size, PAGE_SIZE))
+		return VM_FAULT_SIGBUS;
+
+	/* a mapped page may be written at any time, so it is never one
+	 * shared with a snapshot */
+	down_read(&priv->snap_rwsem);
+	if (pcd_populate(priv, (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE,
+			 GFP_KERNEL)) {
+		up_read(&priv->snap_rwsem);
+		return VM_FAULT_OOM;
+	}
+	page = xa_load(&priv->pages, vmf->pgoff);
+	get_page(page);
+	up_read(&priv->snap_rwsem);
+
+	if (vmf->flags & FAULT_FLAG_WRITE)
+		pcd_mark_dirty(priv, (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE);
+
+	vmf->page = page;
+	return 0;
+}
+
+static void pcd_vm_open(struct vm_area_struct *vma)
+{
+	struct pcdev_private_data *priv = vma->vm_private_data;
+
+	atomic_inc(&priv->nr_mappings);
+}
+
+static void pcd_vm_close(struct vm_area_struct *vma)
+{
+	struct pcdev_private_data *priv = vma->vm_private_data;
+
+	/* only the first store to a page faults, the others are written
+	 * through the writable PTE it left; marked before the mapping stops
+	 * counting, so that the shrinker never sees them clean */
+	if ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) ==
+	    (VM_SHARED | VM_MAYWRITE))
+		pcd_mark_all_dirty(priv);
+	atomic_dec(&priv->nr_mappings);
+}
+
+static const struct vm_operations_struct pcd_vm_ops = {
+	.open = pcd_vm_open,
+	.close = pcd_vm_close,
+	.fault = pcd_vm_fault,
+};
+
+int pcd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)filp->private_data;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+
+	pr_debug("mmap requested for %lu bytes at offset %lu\n", len, off);
+
+	/* Only a flat buffer has a fixed layout to map */
+	if (priv->pdata.mode != PCD_MODE_FLAT)
+		return -ENODEV;
+
+	/* Write-only devices can not be mapped at all */
+	if (priv->pdata.perm == WRONLY) {
+		pcd_stats_inc(priv, PCD_STAT_EPERM);
+		return -EPERM;
+	}
+
+	/* Read-only devices can only be mapped with PROT_READ */
+	if (priv->pdata.perm == RDONLY) {
+		if (vma->vm_flags & VM_WRITE) {
+			pcd_stats_inc(priv, PCD_STAT_EPERM);
+			return -EPERM;
+		}
+		/* also forbid a later mprotect(PROT_WRITE) on the mapping */
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
 
-int pcd_open(struct inode *inode, struct file *filp);
-int pcd_release(struct inode *inode, struct file *flip);
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos);
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos);
-loff_t pcd_lseek(struct file *filp, loff_t offset, int whence);
+	if ((off > PAGE_ALIGN(priv->pdata.size)) ||
+	    (len > PAGE_ALIGN(priv->pdata.size) - off))
+		return -EINVAL;
 
-int pcd_platform_driver_probe(struct platform_device *pdev);
-int pcd_platform_driver_remove(struct platform_device *pdev);
+	/* Pages are mapped one by one as they are touched */
+	vma->vm_ops = &pcd_vm_ops;
+	vma->vm_private_data = priv;
+	vma->vm_flags |= VM_DONTEXPAND;
+	pcd_vm_open(vma);
+	return 0;
+}
 
-enum pcdev_names {
-	PCDEVA1X = 0,
-	PCDEVB1X,
-	PCDEVC1X,
-	PCDEVD1X
+/* Pipe buffers holding private copies of device data */
+static const struct pipe_buf_operations pcd_pipe_buf_ops = {
+	.release = generic_pipe_buf_release,
+	.get = generic_pipe_buf_get,
 };
 
-struct device_config {
-	int config_item1;
-	int config_item2;
-};
+static void pcd_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
 
-/* Configuration data of the driver for devices */
-struct device_config pcdev_config[] = {
-	[PCDEVA1X] = {.config_item1 = 60, .config_item2 = 21},
-	[PCDEVB1X] = {.config_item1 = 50, .config_item2 = 22},
-	[PCDEVC1X] = {.config_item1 = 40, .config_item2 = 23},
-	[PCDEVD1X] = {.config_item1 = 30, .config_item2 = 24}
-};
+/*
+ * Moves flat device data to a pipe. The pipe gets pages of its own, filled
+ * in one pass under the seqlock like a read: pipe buffers are read long
+ * after they are queued, and device pages handed to the pipe would show
+ * whatever was written to them meanwhile, half a write included. Rings are
+ * spliced through pcd_read().
+ */
+ssize_t pcd_splice_read(struct file *in, loff_t *ppos,
+			struct pipe_inode_info *pipe, size_t len,
+			unsigned int flags)
+{
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)in->private_data;
+	loff_t max_size = priv->pdata.size;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct bio_vec bvec[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &pcd_pipe_buf_ops,
+		.spd_release = pcd_spd_release,
+	};
+	struct iov_iter to;
+	struct page *page;
+	loff_t start = *ppos;
+	size_t requested = len;
+	size_t copied;
+	size_t chunk;
+	unsigned int seq;
+	ssize_t ret;
 
-/* Device private data structure */
-struct pcdev_private_data {
-	struct pcdev_platform_data pdata;
-	char *buffer;
-	dev_t dev_num;
-	struct cdev cdev;
-};
+	if (priv->pdata.mode != PCD_MODE_FLAT)
+		return generic_file_splice_read(in, ppos, pipe, len, flags);
 
-/* Driver private data structure */
-struct pcdrv_private_data {
-	int total_devices;
-	dev_t device_num_base;
-	struct class * class_pcd;
-	struct device * device_pcd;
-};
+	if (start >= max_size) {
+		ret = 0;
+		goto out;
+	}
+	len = min_t(loff_t, len, max_size - start);
+	len = min_t(size_t, len, PIPE_DEF_BUFFERS * PAGE_SIZE);
+	ret = pcd_reload(priv, start, len);
+	if (ret)
+		goto out;
 
-/* file operations of the driver */
-struct file_operations pcd_fops =
+	for (copied = 0; copied < len; copied += chunk) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page)
+			break;
+		chunk = min_t(size_t, len - copied, PAGE_SIZE);
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = 0;
+		partial[spd.nr_pages].len = chunk;
+		bvec[spd.nr_pages].bv_page = page;
+		bvec[spd.nr_pages].bv_offset = 0;
+		bvec[spd.nr_pages].bv_len = chunk;
+		spd.nr_pages++;
+	}
+	if (!spd.nr_pages) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	len = copied;
+
+	iov_iter_bvec(&to, READ, bvec, spd.nr_pages, len);
+	do {
+		seq = read_seqbegin(&priv->lock);
+		copied = pcd_copy_to_iter(&priv->pages, start, len, &to);
+		if (!read_seqretry(&priv->lock, seq))
+			break;
+		iov_iter_revert(&to, copied);
+	} while (1);
+
+	ret = splice_to_pipe(pipe, &spd);
+	if (ret > 0)
+		*ppos += ret;
+out:
+	pcd_stats_rw(priv, false, requested, ret);
+	trace_pcd_read(priv->id, start, requested, ret);
+	return ret;
+}
+
+__poll_t pcd_poll(struct file *filp, struct poll_table_struct *wait)
 {
-	.open = pcd_open,
-	.release = pcd_release,
-	.read = pcd_read,
-	.write = pcd_write,
-	.llseek = pcd_lseek,
-	.owner = THIS_MODULE
+	struct pcdev_private_data *priv = (struct pcdev_private_data *)filp->private_data;
+	struct pcdev_ring *ring = &priv->ring;
+	__poll_t mask = 0;
+	unsigned int head;
+	unsigned int tail;
+
+	/* a flat buffer can always be read and written */
+	if (priv->pdata.mode == PCD_MODE_FLAT)
+		return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+
+	/* shards drop old records rather than refuse new ones */
+	if (priv->pdata.mode == PCD_MODE_SHARDED) {
+		poll_wait(filp, &priv->read_wq, wait);
+		mask = EPOLLOUT | EPOLLWRNORM;
+		if (pcd_shards_readable(priv))
+			mask |= EPOLLIN | EPOLLRDNORM;
+		return mask;
+	}
+
+	/* and so does the ring buffer; a pending loss reads as EPIPE */
+	if (priv->pdata.mode == PCD_MODE_RECORD) {
+		poll_wait(filp, &priv->read_wq, wait);
+		mask = EPOLLOUT | EPOLLWRNORM;
+		if (pcd_rec_readable(priv))
+			mask |= EPOLLIN | EPOLLRDNORM;
+		return mask;
+	}
+
+	poll_wait(filp, &priv->read_wq, wait);
+	poll_wait(filp, &priv->write_wq, wait);
+
+	/* ask the other side for a wakeup before looking at the cursors */
+	if (filp->f_mode & FMODE_READ)
+		pcd_ring_sleep(&ring->reader_waiting);
+	if (filp->f_mode & FMODE_WRITE)
+		pcd_ring_sleep(&ring->writer_waiting);
+
+	head = smp_load_acquire(&ring->head);
+	tail = smp_load_acquire(&ring->tail);
+	if (head != tail)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (head - tail <= ring->mask)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+/*
+ * Block device front end. Every hardware context serves requests on its
+ * own, through the same flat read and write paths as the character
+ * device, so that snapshots, write-back and statistics cover both.
+ */
+static blk_status_t pcd_blk_rw(struct pcdev_private_data *priv,
+			       struct request *rq, bool write)
+{
+	loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+	struct req_iterator iter;
+	struct iov_iter it;
+	struct bio_vec bvec;
+	ssize_t ret;
+
+	rq_for_each_segment(bvec, rq, iter) {
+		iov_iter_bvec(&it, write ? WRITE : READ, &bvec, 1, bvec.bv_len);
+		if (write)
+			ret = pcd_flat_write(priv, pos, &it, false);
+		else
+			ret = pcd_flat_read(priv, pos, &it);
+		pcd_stats_rw(priv, write, bvec.bv_len, ret);
+		if (ret != bvec.bv_len)
+			return BLK_STS_IOERR;
+		pos += ret;
+	}
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t pcd_queue_rq(struct blk_mq_hw_ctx *hctx,
+				 const struct blk_mq_queue_data *bd)
+{
+	struct pcdev_private_data *priv = hctx->queue->queuedata;
+	struct request *rq = bd->rq;
+	blk_status_t status;
+	int ret;
+
+	blk_mq_start_request(rq);
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		status = pcd_blk_rw(priv, rq, false);
+		break;
+	case REQ_OP_WRITE:
+		status = pcd_blk_rw(priv, rq, true);
+		break;
+	case REQ_OP_FLUSH:
+		/* the write cache is only announced with a backing file */
+		ret = priv->backing ? pcd_writeback(priv) : 0;
+		if (!ret && priv->backing)
+			ret = vfs_fsync(priv->backing, 1);
+		status = errno_to_blk_status(ret);
+		break;
+	default:
+		status = BLK_STS_NOTSUPP;
+		break;
+	}
+
+	blk_mq_end_request(rq, status);
+	return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops pcd_mq_ops = {
+	.queue_rq = pcd_queue_rq,
 };
 
-struct platform_device_id pcdevs_ids[] = {
-	[0] = {.name = "pcdev-A1x", .driver_data = PCDEVA1X},
-	[1] = {.name = "pcdev-B1x", .driver_data = PCDEVB1X},
-	[2] = {.name = "pcdev-C1x", .driver_data = PCDEVC1X},
-	[3] = {.name = "pcdev-D1x", .driver_data = PCDEVD1X},
-	{}
+static const struct block_device_operations pcd_blk_fops = {
+	.owner = THIS_MODULE,
 };
 
-struct platform_driver pcd_platform_driver =
+/* Creates /dev/pcdblk<id>, one hardware queue per CPU */
+static int pcd_blk_add(struct pcdev_private_data *priv)
 {
-	.probe = pcd_platform_driver_probe,
-	.remove = pcd_platform_driver_remove,
-	.id_table = pcdevs_ids,
-	.driver = {
-		.name = "pseudo-char-device"
+	struct blk_mq_tag_set *set = &priv->tag_set;
+	struct request_queue *q;
+	struct gendisk *disk;
+	int ret;
+
+	set->ops = &pcd_mq_ops;
+	set->nr_hw_queues = nr_cpu_ids;
+	set->queue_depth = 128;
+	set->numa_node = priv->node;
+	/* requests sleep in the page allocator and on snap_rwsem */
+	set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+	set->driver_data = priv;
+	ret = blk_mq_alloc_tag_set(set);
+	if (ret)
+		return ret;
+
+	q = blk_mq_init_queue(set);
+	if (IS_ERR(q)) {
+		ret = PTR_ERR(q);
+		goto free_tag_set;
+	}
+	q->queuedata = priv;
+	blk_queue_logical_block_size(q, SECTOR_SIZE);
+	blk_queue_physical_block_size(q, PAGE_SIZE);
+	blk_queue_max_hw_sectors(q, PCD_MAX_WRITE >> SECTOR_SHIFT);
+	blk_queue_flag_set(QUEUE_FLAG_NONROT, q);
+	if (priv->backing)
+		blk_queue_write_cache(q, true, false);
+
+	disk = alloc_disk(1);
+	if (!disk) {
+		ret = -ENOMEM;
+		goto cleanup_queue;
 	}
+	disk->major = pcdrv_private_data.blk_major;
+	disk->first_minor = MINOR(priv->dev_num);
+	disk->fops = &pcd_blk_fops;
+	disk->private_data = priv;
+	disk->queue = q;
+	snprintf(disk->disk_name, DISK_NAME_LEN, "pcdblk%d", priv->id);
+	/* a trailing partial sector is only reachable through the char
+	 * device */
+	set_capacity(disk, priv->pdata.size >> SECTOR_SHIFT);
+	set_disk_ro(disk, priv->pdata.perm == RDONLY);
+	add_disk(disk);
+
+	priv->disk = disk;
+	return 0;
+
+cleanup_queue:
+	blk_cleanup_queue(q);
+free_tag_set:
+	blk_mq_free_tag_set(set);
+	return ret;
+}
+
+static void pcd_blk_del(struct pcdev_private_data *priv)
+{
+	if (!priv->disk)
+		return;
+
+	del_gendisk(priv->disk);
+	blk_cleanup_queue(priv->disk->queue);
+	blk_mq_free_tag_set(&priv->tag_set);
+	put_disk(priv->disk);
+	priv->disk = NULL;
+}
+
+/* sysfs attributes under /sys/class/pcd_class/pcdev-<id>/stats/ */
+#define PCD_STAT_ATTR(_name, _item)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct pcdev_private_data *priv = dev_get_drvdata(dev);		\
+									\
+	return sprintf(buf, "%llu\n", pcd_stats_sum(priv, _item));	\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+PCD_STAT_ATTR(bytes_read, PCD_STAT_BYTES_READ);
+PCD_STAT_ATTR(bytes_written, PCD_STAT_BYTES_WRITTEN);
+PCD_STAT_ATTR(reads, PCD_STAT_READS);
+PCD_STAT_ATTR(writes, PCD_STAT_WRITES);
+PCD_STAT_ATTR(short_reads, PCD_STAT_SHORT_READS);
+PCD_STAT_ATTR(short_writes, PCD_STAT_SHORT_WRITES);
+PCD_STAT_ATTR(efault, PCD_STAT_EFAULT);
+PCD_STAT_ATTR(enomem, PCD_STAT_ENOMEM);
+PCD_STAT_ATTR(eperm, PCD_STAT_EPERM);
+
+static struct attribute *pcd_stats_attrs[] = {
+	&dev_attr_bytes_read.attr,
+	&dev_attr_bytes_written.attr,
+	&dev_attr_reads.attr,
+	&dev_attr_writes.attr,
+	&dev_attr_short_reads.attr,
+	&dev_attr_short_writes.attr,
+	&dev_attr_efault.attr,
+	&dev_attr_enomem.attr,
+	&dev_attr_eperm.attr,
+	NULL
 };
 
-/* Driver private data structure */
-static struct pcdrv_private_data pcdrv_private_data;
+static const struct attribute_group pcd_stats_group = {
+	.name = "stats",
+	.attrs = pcd_stats_attrs,
+};
 
-static int check_permission(int dev_perm, int acc_mode)
+/* sysfs attributes under /sys/class/pcd_class/pcdev-<id>/numa/ */
+static ssize_t pcd_numa_policy_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
 {
-	if (dev_perm == RDWR)
-		return 0;
-	else if ((dev_perm == RDONLY) && (acc_mode & FMODE_READ)
-		&& !(acc_mode & FMODE_WRITE))
-		return 0;
-	else if ((dev_perm == WRONLY) && (acc_mode & FMODE_WRITE)
-		&& !(acc_mode & FMODE_READ))
-		return 0;
+	static const char * const policies[] = {
+		[PCD_NUMA_DEFAULT] = "default",
+		[PCD_NUMA_PREFERRED] = "preferred",
+		[PCD_NUMA_INTERLEAVE] = "interleave",
+	};
+	struct pcdev_private_data *priv = dev_get_drvdata(dev);
 
-	return -EPERM;
+	return sprintf(buf, "%s\n", policies[priv->pdata.numa_policy]);
 }
 
-int pcd_open(struct inode *inode, struct file *filp)
+static ssize_t pcd_numa_node_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
 {
-	int ret;
-	int minor_n;
-	struct pcdev_private_data *priv;
+	struct pcdev_private_data *priv = dev_get_drvdata(dev);
 
-	/* find out on which device file open was attempted by the user space */
-	minor_n = MINOR(inode->i_rdev);
-	pr_info("Minor access = %d\n", minor_n);
+	return sprintf(buf, "%d\n", priv->node);
+}
 
-	/* gets device's private data structure */
-	priv = container_of(inode->i_cdev, struct pcdev_private_data, cdev);
-	/* supply device private data to other methods of the driver */
-	filp->private_data = priv;
+/* Number of allocated pages on each node, as "N<node>=<pages> ..." */
+static ssize_t pcd_numa_pages_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct pcdev_private_data *priv = dev_get_drvdata(dev);
+	unsigned long *nr_pages;
+	unsigned long index;
+	struct page *page;
+	ssize_t len = 0;
+	int nid;
 
-	/* check permission */
-	ret = check_permission(priv->pdata.perm, filp->f_mode);
-	if (ret)
-		pr_info("Open unsuccesful\n");
-	else
-		pr_info("Open was successful\n");
+	nr_pages = kcalloc(nr_node_ids, sizeof(*nr_pages), GFP_KERNEL);
+	if (!nr_pages)
+		return -ENOMEM;
 
-	return ret;
+	xa_for_each(&priv->pages, index, page)
+		nr_pages[page_to_nid(page)]++;
+
+	for_each_node(nid)
+		if (nr_pages[nid])
+			len += scnprintf(buf + len, PAGE_SIZE - len, "N%d=%lu ",
+					 nid, nr_pages[nid]);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	kfree(nr_pages);
+	return len;
 }
 
-int pcd_release(struct inode *inode, struct file *flip)
+static struct device_attribute dev_attr_numa_policy =
+	__ATTR(policy, 0444, pcd_numa_policy_show, NULL);
+static struct device_attribute dev_attr_numa_node =
+	__ATTR(node, 0444, pcd_numa_node_show, NULL);
+static struct device_attribute dev_attr_numa_pages =
+	__ATTR(pages, 0444, pcd_numa_pages_show, NULL);
+
+static struct attribute *pcd_numa_attrs[] = {
+	&dev_attr_numa_policy.attr,
+	&dev_attr_numa_node.attr,
+	&dev_attr_numa_pages.attr,
+	NULL
+};
+
+static const struct attribute_group pcd_numa_group = {
+	.name = "numa",
+	.attrs = pcd_numa_attrs,
+};
+
+static const struct attribute_group *pcd_dev_groups[] = {
+	&pcd_stats_group,
+	&pcd_numa_group,
+	NULL
+};
+
+/*
+ * debugfs files under /sys/kernel/debug/pcd/pcdev-<id>/:
+ *
+ *	latency_enable	write 1 to start recording latencies, 0 to stop
+ *	latency		one "<op> <size> <ns> <count>" line per non-empty
+ *			bucket: <count> <op> calls of up to <size> bytes took
+ *			at least <ns> and less than twice as long
+ *	latency_reset	write anything to clear the histograms
+ *	relay<cpu>	with relay_subbufs set, everything written to the
+ *			device through write() and PCD_IOC_SG, in the
+ *			sub-buffers of the CPU that wrote it, framed by
+ *			struct pcd_relay_chunk
+ *	relay_flush	write anything to hand partly filled sub-buffers
+ *			to readers
+ *
+ * Neither reading nor clearing the histograms takes a lock the I/O paths
+ * use; a clear racing with an operation may only lose that operation.
+ */
+static const char * const pcd_lat_ops[PCD_LAT_MAX] = {
+	[PCD_LAT_OPEN] = "open",
+	[PCD_LAT_READ] = "read",
+	[PCD_LAT_WRITE] = "write",
+	[PCD_LAT_LSEEK] = "lseek",
+};
+
+static const char * const pcd_lat_sizes[PCD_LAT_SIZES] = {
+	"0", "64", "512", "4K", "32K", "256K", "2M", "max",
+};
+
+static int pcd_lat_show(struct seq_file *m, void *v)
 {
-	pr_info("Release was succesful\n");
+	struct pcdev_private_data *priv = m->private;
+	int op, size, bucket, cpu;
+	u64 count;
+
+	mutex_lock(&pcd_lat_mutex);
+	if (!priv->lat)
+		goto unlock;
+
+	for (op = 0; op < PCD_LAT_MAX; op++)
+		for (size = 0; size < PCD_LAT_SIZES; size++)
+			for (bucket = 0; bucket < PCD_LAT_BUCKETS; bucket++) {
+				count = 0;
+				for_each_possible_cpu(cpu)
+					count += READ_ONCE(per_cpu_ptr(priv->lat,
+						cpu)->count[op][size][bucket]);
+				if (count)
+					seq_printf(m, "%s %s %llu %llu\n",
+						   pcd_lat_ops[op],
+						   pcd_lat_sizes[size],
+						   1ULL << bucket, count);
+			}
+
+unlock:
+	mutex_unlock(&pcd_lat_mutex);
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(pcd_lat);
 
-ssize_t pcd_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos)
+static int pcd_lat_enable_get(void *data, u64 *val)
 {
-	struct pcdev_private_data *priv = (struct pcdev_private_data *)filp->private_data;
-	int max_size = priv->pdata.size;
+	struct pcdev_private_data *priv = data;
 
-	pr_info("Read requested for %zu bytes\n", count);
-	pr_info("Current file position = %lld\n", *f_pos);
+	*val = READ_ONCE(priv->lat_enabled);
+	return 0;
+}
 
-	/* Adjust the 'count' */
-	if ((*f_pos + count) > max_size)
-		count = max_size - *f_pos;
+static int pcd_lat_enable_set(void *data, u64 val)
+{
+	struct pcdev_private_data *priv = data;
+	int ret = 0;
 
-	/* copy to user */
-	if (copy_to_user(buff, &priv->buffer[*f_pos], count)) {
-		return -EFAULT;
+	mutex_lock(&pcd_lat_mutex);
+	if (val && !priv->lat_enabled) {
+		if (!priv->lat)
+			priv->lat = alloc_percpu(struct pcdev_lat);
+		if (!priv->lat) {
+			ret = -ENOMEM;
+			goto unlock;
+		}
+		smp_store_release(&priv->lat_enabled, true);
+		static_branch_inc(&pcd_lat_key);
+	} else if (!val && priv->lat_enabled) {
+		WRITE_ONCE(priv->lat_enabled, false);
+		static_branch_dec(&pcd_lat_key);
 	}
+unlock:
+	mutex_unlock(&pcd_lat_mutex);
+	return ret;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(pcd_lat_enable_fops, pcd_lat_enable_get,
+			 pcd_lat_enable_set, "%llu\n");
 
-	/* update the current file position */
-	*f_pos += count;
-	pr_info("Number of bytes succesfully read = %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
+static int pcd_lat_reset_set(void *data, u64 val)
+{
+	struct pcdev_private_data *priv = data;
+	int cpu;
 
-	/* return the number of bytes which have been succesfully read */
-	return count;
+	mutex_lock(&pcd_lat_mutex);
+	if (priv->lat)
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(priv->lat, cpu), 0,
+			       sizeof(struct pcdev_lat));
+	mutex_unlock(&pcd_lat_mutex);
+	return 0;
 }
+DEFINE_DEBUGFS_ATTRIBUTE(pcd_lat_reset_fops, NULL, pcd_lat_reset_set,
+			 "%llu\n");
 
-ssize_t pcd_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos)
+static int pcd_relay_flush_set(void *data, u64 val)
 {
-	struct pcdev_private_data *priv = (struct pcdev_private_data *)filp->private_data;
-	int max_size = priv->pdata.size;
+	struct pcdev_private_data *priv = data;
+	struct rchan *chan;
+	int idx;
 
-	pr_info("Write requested for %zu bytes \n", count);
-	pr_info("Current file position = %lld\n", *f_pos);
+	idx = srcu_read_lock(&pcd_relay_srcu);
+	chan = srcu_dereference(priv->relay, &pcd_relay_srcu);
+	if (chan)
+		relay_flush(chan);
+	srcu_read_unlock(&pcd_relay_srcu, idx);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(pcd_relay_flush_fops, NULL, pcd_relay_flush_set,
+			 "%llu\n");
 
-	/* Adjust the 'count' */
-	if (((*f_pos) + count) > max_size)
-		count = max_size - (*f_pos);
+static struct dentry *pcd_relay_create(const char *filename,
+				       struct dentry *parent, umode_t mode,
+				       struct rchan_buf *buf, int *is_global)
+{
+	struct dentry *dentry;
 
-	if(!count)
-	{
-		pr_err("No space left on the device!\n");
-		return -ENOMEM;
-	}
+	dentry = debugfs_create_file(filename, mode, parent, buf,
+				     &relay_file_operations);
+	return IS_ERR(dentry) ? NULL : dentry;
+}
 
-	/* copy from user */
-	if (copy_from_user(&priv->buffer[*f_pos], buff, count)) {
-		return -EFAULT;
-	}
+static int pcd_relay_remove(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
 
-	/* update the current file position */
-	*f_pos += count;
-	pr_info("Number of bytes written successfully = %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
+static struct rchan_callbacks pcd_relay_cbs = {
+	.create_buf_file = pcd_relay_create,
+	.remove_buf_file = pcd_relay_remove,
+};
 
-	/* return the number of bytes which have been succesfully writen */
-	return count;
+/* debugfs is best effort, a device works the same without it */
+static void pcd_debugfs_add(struct pcdev_private_data *priv)
+{
+	struct rchan *chan;
+	char name[32];
+
+	snprintf(name, sizeof(name), "pcdev-%d", priv->id);
+	priv->debugfs = debugfs_create_dir(name, pcd_debugfs_root);
+	debugfs_create_file_unsafe("latency_enable", 0600, priv->debugfs,
+				   priv, &pcd_lat_enable_fops);
+	debugfs_create_file("latency", 0400, priv->debugfs, priv,
+			    &pcd_lat_fops);
+	debugfs_create_file_unsafe("latency_reset", 0200, priv->debugfs,
+				   priv, &pcd_lat_reset_fops);
+
+	if (!relay_subbufs || IS_ERR(priv->debugfs))
+		return;
+	chan = relay_open("relay", priv->debugfs, relay_subbuf_size,
+			  relay_subbufs, &pcd_relay_cbs, NULL);
+	rcu_assign_pointer(priv->relay, chan);
+	if (chan)
+		debugfs_create_file_unsafe("relay_flush", 0200,
+					   priv->debugfs, priv,
+					   &pcd_relay_flush_fops);
+	else
+		pr_info("No relay channel for pcdev-%d\n", priv->id);
 }
 
-loff_t pcd_lseek(struct file *filp, loff_t off, int whence)
+static void pcd_debugfs_del(struct pcdev_private_data *priv)
 {
-	loff_t temp;
-	struct pcdev_private_data *priv = (struct pcdev_private_data *)filp->private_data;
-	int max_size = priv->pdata.size;
+	struct rchan *chan = rcu_dereference_protected(priv->relay, true);
 
-	pr_info("lseek requested\n");
-	pr_info("Current file position = %lld\n", filp->f_pos);
-
-	switch(whence)
-	{
-		case SEEK_SET:
-			if( (off > max_size) || (off < 0))
-				return -EINVAL;
-			filp->f_pos = off;
-			break;
-		case SEEK_CUR:
-			temp = filp->f_pos + off;
-			if ((temp > max_size) || (temp < 0))
-				return -EINVAL;
-			filp->f_pos = temp;
-			break;
-		case SEEK_END:
-			temp = max_size + off;
-			if ((temp > max_size) || (temp < 0))
-				return -EINVAL;
-			filp->f_pos = max_size + off;
-			break;
-		default:
-			return -EINVAL;
+	/* the relay files go first, they are removed through the channel;
+	 * writers on files still open must be done with it before that */
+	if (chan) {
+		RCU_INIT_POINTER(priv->relay, NULL);
+		synchronize_srcu(&pcd_relay_srcu);
+		relay_close(chan);
 	}
+	debugfs_remove_recursive(priv->debugfs);
+	/* the histograms themselves go with the private data */
+	mutex_lock(&pcd_lat_mutex);
+	if (priv->lat_enabled) {
+		WRITE_ONCE(priv->lat_enabled, false);
+		static_branch_dec(&pcd_lat_key);
+	}
+	mutex_unlock(&pcd_lat_mutex);
+}
 
-	pr_info("New value of file pointer = %lld\n", filp->f_pos);
-	return filp->f_pos;
+/*
+ * The private data outlives the platform device while it is still in use:
+ * each cdev holds a reference for as long as a file opened through it is
+ * around, which also covers its mappings. A removed device can not be opened
+ * any more, but what is still open keeps working on its storage; the storage
+ * is only written back and freed once the last reference is gone.
+ */
+static void pcd_priv_release(struct kobject *kobj)
+{
+	struct pcdev_private_data *priv = container_of(kobj,
+					struct pcdev_private_data, kobj);
+
+	if (priv->snap)
+		kref_put(&priv->snap->ref, pcd_snap_free);
+	pcd_backing_close(priv);
+	bitmap_free(priv->evicted);
+	pcd_rec_free(priv);
+	pcd_shards_free(priv);
+	pcd_free_pages(priv);
+	free_percpu(priv->lat);
+	free_percpu(priv->stats);
+	kfree(priv);
+}
+
+static struct kobj_type pcd_priv_ktype = {
+	.release = pcd_priv_release,
+};
+
+/* Traces how long a probe step took, then starts timing the next one */
+static void pcd_probe_time(struct platform_device *pdev, const char *step,
+			   ktime_t *start)
+{
+	ktime_t now = ktime_get();
+
+	trace_pcd_probe_step(pdev->id, step, ktime_to_ns(ktime_sub(now, *start)));
+	*start = now;
 }
 
 /* Get's called when matched platform device is found */
 int pcd_platform_driver_probe(struct platform_device *pdev)
 {
 	int ret;
+	int cpu;
 	struct pcdev_private_data *dev_priv;
 	struct pcdev_platform_data *dev_plat;
 	struct pcdrv_private_data *drv_priv = &pcdrv_private_data;
+	ktime_t probe_start = ktime_get();
+	ktime_t step_start = probe_start;
 
-	pr_info("A device is detected!\n");
+	pr_debug("A device is detected!\n");
 
 	/* 1. Get the platform data */
 	dev_plat = (struct pcdev_platform_data *)dev_get_platdata(&pdev->dev);
@@ -250,74 +3565,249 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
 		goto out;
 	}
 
-	/* 2. Dynamically allocate data for the device private data */
-	dev_priv = devm_kzalloc(&pdev->dev, sizeof(*dev_priv), GFP_KERNEL);
+	/* 2. Dynamically allocate data for the device private data. It is
+	 * not device managed, since it may outlive the platform device. */
+	dev_priv = kzalloc_node(sizeof(*dev_priv), GFP_KERNEL,
+				dev_to_node(&pdev->dev));
 	if (!dev_priv)
 	{
 		pr_info("Cannot allocate memory!\n");
 		ret = -ENOMEM;
 		goto out;
 	}
+	kobject_init(&dev_priv->kobj, &pcd_priv_ktype);
+	xa_init(&dev_priv->pages);
+	mutex_init(&dev_priv->wb_lock);
+	INIT_DELAYED_WORK(&dev_priv->wb_work, pcd_wb_work);
 
 	/* Save device data in dev structure so it could be removed in remove
 	 * function */
 	dev_set_drvdata(&pdev->dev, dev_priv);
 
 	memcpy(&dev_priv->pdata, dev_plat, sizeof(*dev_plat));
-	pr_info("Device serial number: %s\n", dev_priv->pdata.serial_number);
-	pr_info("Device permission: 0x%X\n", dev_priv->pdata.perm);
+	dev_priv->id = pdev->id;
+	pr_debug("Device serial number: %s\n", dev_priv->pdata.serial_number);
+	pr_debug("Device permission: 0x%X\n", dev_priv->pdata.perm);
 
-	pr_info("Config item 1 = %d\n",
-		pcdev_config[pdev->id_entry->driver_data].config_item1);
-	pr_info("Config item 2 = %d\n",
-		pcdev_config[pdev->id_entry->driver_data].config_item2);
+	pr_debug("Config item 1 = %d\n",
+		 pcdev_config[pdev->id_entry->driver_data].config_item1);
+	pr_debug("Config item 2 = %d\n",
+		 pcdev_config[pdev->id_entry->driver_data].config_item2);
 
-	pr_info("Device size: %u\n", dev_priv->pdata.size);
+	pr_debug("Device size: %lld\n", dev_priv->pdata.size);
+	pcd_probe_time(pdev, "alloc", &step_start);
 
-	/* 3. Dynamically allocate data for the device buffer using
-	 * size information from the platform data. */
-	dev_priv->buffer = devm_kzalloc(&pdev->dev, dev_priv->pdata.size,
-					GFP_KERNEL);
-	if (!dev_priv)
+	/* 3. Set up the device storage. Its pages are only allocated when
+	 * they are first written (or mapped), so that large devices cost
+	 * nothing until they are used. */
+	if (dev_priv->pdata.size <= 0)
+	{
+		pr_err("Invalid device size!\n");
+		ret = -EINVAL;
+		goto put_dev_priv;
+	}
+
+	/* Pages go to the node of the platform device unless its platform
+	 * data prefers another one, or asks for them to be interleaved */
+	switch (dev_priv->pdata.numa_policy) {
+	case PCD_NUMA_DEFAULT:
+		dev_priv->node = dev_to_node(&pdev->dev);
+		break;
+	case PCD_NUMA_PREFERRED:
+		dev_priv->node = dev_priv->pdata.numa_node;
+		if (dev_priv->node < 0 || dev_priv->node >= MAX_NUMNODES ||
+		    !node_online(dev_priv->node))
+		{
+			pr_err("Invalid NUMA node %d!\n", dev_priv->node);
+			ret = -EINVAL;
+			goto put_dev_priv;
+		}
+		break;
+	case PCD_NUMA_INTERLEAVE:
+		dev_priv->node = NUMA_NO_NODE;
+		break;
+	default:
+		pr_err("Invalid NUMA policy %d!\n", dev_priv->pdata.numa_policy);
+		ret = -EINVAL;
+		goto put_dev_priv;
+	}
+
+	/* Only a flat device can give its pages back, and only to lose
+	 * them or to read them back from its backing file */
+	if ((dev_priv->pdata.reclaim != PCD_RECLAIM_NONE &&
+	     dev_priv->pdata.reclaim != PCD_RECLAIM_CLEAN &&
+	     dev_priv->pdata.reclaim != PCD_RECLAIM_DISCARD) ||
+	    (dev_priv->pdata.reclaim != PCD_RECLAIM_NONE &&
+	     dev_priv->pdata.mode != PCD_MODE_FLAT) ||
+	    (dev_priv->pdata.reclaim == PCD_RECLAIM_CLEAN &&
+	     !dev_priv->pdata.backing_file))
+	{
+		pr_err("Invalid reclaim policy %d!\n", dev_priv->pdata.reclaim);
+		ret = -EINVAL;
+		goto put_dev_priv;
+	}
+
+	seqlock_init(&dev_priv->lock);
+	init_rwsem(&dev_priv->snap_rwsem);
+	mutex_init(&dev_priv->snap_lock);
+	init_waitqueue_head(&dev_priv->read_wq);
+	init_waitqueue_head(&dev_priv->write_wq);
+	init_waitqueue_head(&dev_priv->reclaim_wq);
+
+	/* A ring uses the largest power of two that fits in the buffer, so
+	 * that its free-running cursors can simply be masked */
+	mutex_init(&dev_priv->ring.write_lock);
+	mutex_init(&dev_priv->ring.read_lock);
+	if (dev_priv->pdata.mode == PCD_MODE_SPSC)
+		dev_priv->ring.mask = rounddown_pow_of_two(min_t(loff_t,
+					dev_priv->pdata.size, PCD_MAX_RING)) - 1;
+
+	/* Shards are split off the buffer size, one per possible CPU */
+	mutex_init(&dev_priv->shard_read_lock);
+	if (dev_priv->pdata.mode == PCD_MODE_SHARDED)
+	{
+		ret = pcd_shards_alloc(dev_priv);
+		if (ret)
+		{
+			pr_info("Cannot allocate memory!\n");
+			goto put_dev_priv;
+		}
+	}
+
+	/* Records go to the kernel ring buffer, sized after the buffer */
+	mutex_init(&dev_priv->rec_read_lock);
+	if (dev_priv->pdata.mode == PCD_MODE_RECORD)
+	{
+		ret = pcd_rec_alloc(dev_priv, dev_priv->pdata.size);
+		if (ret)
+		{
+			pr_info("Cannot allocate memory!\n");
+			goto put_dev_priv;
+		}
+	}
+
+	dev_priv->stats = alloc_percpu(struct pcdev_stats);
+	if (!dev_priv->stats)
 	{
 		pr_info("Cannot allocate memory!\n");
 		ret = -ENOMEM;
-		goto free_dev_priv;
+		goto put_dev_priv;
+	}
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(dev_priv->stats, cpu)->syncp);
+	pcd_probe_time(pdev, "storage", &step_start);
+
+	/* A flat device may persist in a backing file, which it starts
+	 * from */
+	if (dev_priv->pdata.backing_file)
+	{
+		if (dev_priv->pdata.mode != PCD_MODE_FLAT)
+		{
+			pr_err("Only flat devices can have a backing file!\n");
+			ret = -EINVAL;
+			goto put_dev_priv;
+		}
+		dev_priv->backing = filp_open(dev_priv->pdata.backing_file,
+					      O_RDWR | O_CREAT | O_LARGEFILE,
+					      0600);
+		if (IS_ERR(dev_priv->backing))
+		{
+			pr_err("Cannot open %s!\n", dev_priv->pdata.backing_file);
+			ret = PTR_ERR(dev_priv->backing);
+			dev_priv->backing = NULL;
+			goto put_dev_priv;
+		}
+		ret = pcd_backing_load(dev_priv);
+		if (ret)
+		{
+			pr_err("Cannot load %s!\n", dev_priv->pdata.backing_file);
+			goto put_dev_priv;
+		}
+		/* Pages the shrinker drops are read back from the file */
+		if (dev_priv->pdata.reclaim != PCD_RECLAIM_NONE)
+		{
+			dev_priv->evicted = bitmap_zalloc(DIV_ROUND_UP(
+					dev_priv->pdata.size, PAGE_SIZE),
+					GFP_KERNEL);
+			if (!dev_priv->evicted)
+			{
+				pr_info("Cannot allocate memory!\n");
+				ret = -ENOMEM;
+				goto put_dev_priv;
+			}
+		}
+		pcd_probe_time(pdev, "backing", &step_start);
 	}
 
-	/* 4. Get the device number */
-	dev_priv->dev_num = drv_priv->device_num_base + pdev->id;
+	/* 4. Get the device number, from the lowest free minor */
+	ret = ida_alloc_max(&pcd_minor_ida, MAX_DEVICES - 1, GFP_KERNEL);
+	if (ret < 0) {
+		pr_err("No minor number left!\n");
+		goto put_dev_priv;
+	}
+	dev_priv->dev_num = MKDEV(MAJOR(drv_priv->device_num_base), ret);
+	pcd_probe_time(pdev, "minor", &step_start);
 
 	/* 5. Do cdev init and cdev add */
 	cdev_init(&dev_priv->cdev, &pcd_fops);
 	dev_priv->cdev.owner = THIS_MODULE;
+	cdev_set_parent(&dev_priv->cdev, &dev_priv->kobj);
 	ret = cdev_add(&dev_priv->cdev, dev_priv->dev_num, 1);
 	if (ret < 0) {
 		pr_err("cdev_add failed!\n");
-		goto free_buff;
+		goto free_minor;
 	}
+	pcd_probe_time(pdev, "cdev_add", &step_start);
 
-	/* 6. Create device file for the detected platform device */
-	drv_priv->device_pcd = device_create(drv_priv->class_pcd, NULL,
-			                     dev_priv->dev_num, NULL,
-				             "pcdev-%d", pdev->id);
-	if (IS_ERR(drv_priv->device_pcd)) {
+	/* 6. Create device file for the detected platform device, along
+	 * with its statistics attributes */
+	dev_priv->device = device_create_with_groups(drv_priv->class_pcd,
+					NULL, dev_priv->dev_num, dev_priv,
+					pcd_dev_groups, "pcdev-%d", pdev->id);
+	if (IS_ERR(dev_priv->device)) {
 		pr_err("device_create failed!\n");
-		ret = PTR_ERR(drv_priv->device_pcd);
+		ret = PTR_ERR(dev_priv->device);
 		goto cdev_del;
 	}
+	pcd_probe_time(pdev, "device_create", &step_start);
+
+	/* 7. Expose a flat device as a block device too, if asked to. It
+	 * must be readable and hold at least one sector. */
+	if (drv_priv->blk_major && (dev_priv->pdata.mode == PCD_MODE_FLAT) &&
+	    (dev_priv->pdata.perm != WRONLY) &&
+	    (dev_priv->pdata.size >= SECTOR_SIZE))
+	{
+		ret = pcd_blk_add(dev_priv);
+		if (ret)
+		{
+			pr_err("Cannot add the block device!\n");
+			goto device_destroy;
+		}
+		pcd_probe_time(pdev, "blkdev", &step_start);
+	}
 
-	/* 7. Error handling */
-	drv_priv->total_devices++;
-	pr_info("Probe was successful!\n");
+	/* 8. Error handling */
+	pcd_debugfs_add(dev_priv);
+	if (dev_priv->pdata.reclaim != PCD_RECLAIM_NONE)
+	{
+		mutex_lock(&pcd_devices_lock);
+		list_add_tail(&dev_priv->node, &pcd_devices);
+		mutex_unlock(&pcd_devices_lock);
+	}
+	atomic_inc(&drv_priv->total_devices);
+	pcd_probe_time(pdev, "total", &probe_start);
+	pr_debug("Probe was successful!\n");
 	return 0;
 
+device_destroy:
+	device_destroy(drv_priv->class_pcd, dev_priv->dev_num);
 cdev_del:
 	cdev_del(&dev_priv->cdev);
-free_buff:
-	devm_kfree(&pdev->dev, dev_priv->buffer);
-free_dev_priv:
-	devm_kfree(&pdev->dev, dev_priv);
+free_minor:
+	ida_free(&pcd_minor_ida, MINOR(dev_priv->dev_num));
+put_dev_priv:
+	/* frees whatever storage was set up */
+	kobject_put(&dev_priv->kobj);
 out:
 	pr_err("Device probe failed\n");
 	return ret;
@@ -327,14 +3817,40 @@ int pcd_platform_driver_remove(struct platform_device *pdev)
 {
 	struct pcdev_private_data *dev_priv = dev_get_drvdata(&pdev->dev);
 
-	pr_info("A device is being removed\n");
+	pr_debug("A device is being removed\n");
+	/* 0. Keep the shrinker away, remove the debugfs files and the
+	 * block device, flushing what it still holds */
+	if (dev_priv->pdata.reclaim != PCD_RECLAIM_NONE) {
+		mutex_lock(&pcd_devices_lock);
+		list_del(&dev_priv->node);
+		mutex_unlock(&pcd_devices_lock);
+	}
+	pcd_debugfs_del(dev_priv);
+	pcd_blk_del(dev_priv);
 	/* 1. Remove a device that was created with device_create() */
 	device_destroy(pcdrv_private_data.class_pcd, dev_priv->dev_num);
 	/* 2. Remove a cdev entry from the system */
 	cdev_del(&dev_priv->cdev);
+	/* 3. Give the minor number back */
+	ida_free(&pcd_minor_ida, MINOR(dev_priv->dev_num));
+	/* 4. Remove the snapshot node, and keep a new one from being
+	 * created through a file that is still open; open snapshots stay
+	 * readable until they are closed */
+	mutex_lock(&dev_priv->snap_lock);
+	dev_priv->removed = true;
+	if (dev_priv->snap_device) {
+		device_destroy(pcdrv_private_data.class_pcd, dev_priv->snap_num);
+		cdev_del(&dev_priv->snap_cdev);
+		ida_free(&pcd_minor_ida, MINOR(dev_priv->snap_num));
+	}
+	mutex_unlock(&dev_priv->snap_lock);
+	/* 5. Drop the reference of the platform device. The device is
+	 * written back and its storage freed once nothing uses it any
+	 * more, which is now unless files, mappings or exports remain. */
+	kobject_put(&dev_priv->kobj);
 
-	pcdrv_private_data.total_devices--;
-	pr_info("Device removed!\n");
+	atomic_dec(&pcdrv_private_data.total_devices);
+	pr_debug("Device removed!\n");
 	return 0;
 }
 
@@ -361,11 +3877,41 @@ static int __init pcd_platform_driver_init(void)
 		ret = PTR_ERR(priv->class_pcd);
 		goto unreg_chrdev;
 	}
-	/* 3. Register a platform driver */
-	platform_driver_register(&pcd_platform_driver);
+	/* debugfs is best effort, its failure is not fatal */
+	pcd_debugfs_root = debugfs_create_dir("pcd", NULL);
+	/* 3. Get a block major number, if block devices are asked for */
+	if (blkdev) {
+		ret = register_blkdev(0, "pcdblk");
+		if (ret < 0) {
+			pr_err("register_blkdev failed!\n");
+			goto remove_debugfs;
+		}
+		priv->blk_major = ret;
+	}
+	/* 4. Let memory pressure reclaim idle devices that allow it */
+	ret = register_shrinker(&pcd_shrinker);
+	if (ret < 0) {
+		pr_err("register_shrinker failed!\n");
+		goto unreg_blkdev;
+	}
+	/* 5. Register a platform driver. Matching devices are probed
+	 * asynchronously, and become usable as each probe completes. */
+	ret = platform_driver_register(&pcd_platform_driver);
+	if (ret < 0) {
+		pr_err("platform_driver_register failed!\n");
+		goto unreg_shrinker;
+	}
 	pr_info("Platform driver loaded\n");
 	return 0;
 
+unreg_shrinker:
+	unregister_shrinker(&pcd_shrinker);
+unreg_blkdev:
+	if (priv->blk_major)
+		unregister_blkdev(priv->blk_major, "pcdblk");
+remove_debugfs:
+	debugfs_remove_recursive(pcd_debugfs_root);
+	class_destroy(priv->class_pcd);
 unreg_chrdev:
 	unregister_chrdev_region(priv->device_num_base, MAX_DEVICES);
 	return ret;
@@ -376,10 +3922,15 @@ static void __exit pcd_platform_driver_cleanup(void)
 	struct pcdrv_private_data *priv = &pcdrv_private_data;
 	/* 1. Unregister the platform driver */
 	platform_driver_unregister(&pcd_platform_driver);
+	unregister_shrinker(&pcd_shrinker);
+	if (priv->blk_major)
+		unregister_blkdev(priv->blk_major, "pcdblk");
+	debugfs_remove_recursive(pcd_debugfs_root);
 	/* 2. Class destroy */
 	class_destroy(priv->class_pcd);
 	/* 3. Unregister device numbers for MAX_DEVICES */
 	unregister_chrdev_region(priv->device_num_base, MAX_DEVICES);
+	ida_destroy(&pcd_minor_ida);
 	pr_info("Platform driver unloaded\n");
 	return;
 }
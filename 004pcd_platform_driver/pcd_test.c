@@ -0,0 +1,397 @@
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/limits.h>
+#include <linux/platform_device.h>
+#include <linux/device.h>
+#include <linux/sizes.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+#include <linux/math64.h>
+
+#include "pcd_helpers.h"
+
+/*
+ * KUnit tests of the pcd platform driver. Load pcd_test.ko on a kernel
+ * built with CONFIG_KUNIT; the results are in the kernel log, and under
+ * /sys/kernel/debug/kunit/pcd/ if debugfs is there.
+ *
+ * The boundary checks are tested on their own. The read, write and lseek
+ * paths are driven through devices of the driver itself, created for each
+ * test and opened through devtmpfs, so pcd_platform_driver.ko must be
+ * loaded: kernel_read() and kernel_write() hand them kvec iterators.
+ */
+
+#define PCD_TEST_SIZE 4096
+
+static void pcd_test_clamp_count(struct kunit *test)
+{
+	const loff_t max = PCD_TEST_SIZE;
+
+	/* start, last byte, end and past the end */
+	KUNIT_EXPECT_EQ(test, pcd_clamp_count(0, 16, max), (size_t)16);
+	KUNIT_EXPECT_EQ(test, pcd_clamp_count(0, max, max), (size_t)max);
+	KUNIT_EXPECT_EQ(test, pcd_clamp_count(max - 1, 16, max), (size_t)1);
+	KUNIT_EXPECT_EQ(test, pcd_clamp_count(max, 16, max), (size_t)0);
+	KUNIT_EXPECT_EQ(test, pcd_clamp_count(max + 1, 16, max), (size_t)0);
+
+	/* empty transfers, negative and huge positions */
+	KUNIT_EXPECT_EQ(test, pcd_clamp_count(0, 0, max), (size_t)0);
+	KUNIT_EXPECT_EQ(test, pcd_clamp_count(-1, 16, max), (size_t)0);
+	KUNIT_EXPECT_EQ(test, pcd_clamp_count(LLONG_MAX, 16, max), (size_t)0);
+	KUNIT_EXPECT_EQ(test, pcd_clamp_count(LLONG_MIN, 16, max), (size_t)0);
+
+	/* a count larger than the device, or than any loff_t */
+	KUNIT_EXPECT_EQ(test, pcd_clamp_count(1, SIZE_MAX, max),
+			(size_t)(max - 1));
+	KUNIT_EXPECT_EQ(test, pcd_clamp_count(0, SIZE_MAX, LLONG_MAX),
+			(size_t)min_t(u64, SIZE_MAX, LLONG_MAX));
+}
+
+static void pcd_test_seek_pos(struct kunit *test)
+{
+	const loff_t max = PCD_TEST_SIZE;
+
+	/* SEEK_SET: base 0 */
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(0, 0, max), (loff_t)0);
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(0, max - 1, max), max - 1);
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(0, max, max), max);
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(0, max + 1, max), (loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(0, -1, max), (loff_t)-EINVAL);
+
+	/* SEEK_CUR and SEEK_END: base anywhere up to the end */
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(max - 1, 1, max), max);
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(max, -max, max), (loff_t)0);
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(max, -max - 1, max),
+			(loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(max, 1, max), (loff_t)-EINVAL);
+
+	/* sums that do not fit in a loff_t must not wrap to a valid
+	 * position */
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(max, LLONG_MAX, max),
+			(loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(max, LLONG_MAX - max + 1, max),
+			(loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(-1, LLONG_MIN, max),
+			(loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(LLONG_MAX, LLONG_MAX, LLONG_MAX),
+			(loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, pcd_seek_pos(LLONG_MAX, 0, LLONG_MAX),
+			LLONG_MAX);
+}
+
+static void pcd_test_permission(struct kunit *test)
+{
+	const int r = FMODE_READ;
+	const int w = FMODE_WRITE;
+
+	KUNIT_EXPECT_EQ(test, check_permission(RDWR, r), 0);
+	KUNIT_EXPECT_EQ(test, check_permission(RDWR, w), 0);
+	KUNIT_EXPECT_EQ(test, check_permission(RDWR, r | w), 0);
+
+	KUNIT_EXPECT_EQ(test, check_permission(RDONLY, r), 0);
+	KUNIT_EXPECT_EQ(test, check_permission(RDONLY, w), -EPERM);
+	KUNIT_EXPECT_EQ(test, check_permission(RDONLY, r | w), -EPERM);
+
+	KUNIT_EXPECT_EQ(test, check_permission(WRONLY, w), 0);
+	KUNIT_EXPECT_EQ(test, check_permission(WRONLY, r), -EPERM);
+	KUNIT_EXPECT_EQ(test, check_permission(WRONLY, r | w), -EPERM);
+
+	/* an unknown permission code allows nothing */
+	KUNIT_EXPECT_EQ(test, check_permission(0, r), -EPERM);
+	KUNIT_EXPECT_EQ(test, check_permission(0, w), -EPERM);
+}
+
+/*
+ * Microbenchmark of the checks every read, write and lseek goes through.
+ * It only reports the cost per call; it can not fail.
+ */
+#define PCD_TEST_LOOPS 1000000
+
+static void pcd_test_bench(struct kunit *test)
+{
+	const loff_t max = PCD_TEST_SIZE;
+	u64 sum = 0;
+	ktime_t start;
+	s64 ns;
+	int i;
+
+	start = ktime_get();
+	for (i = 0; i < PCD_TEST_LOOPS; i++)
+		sum += pcd_clamp_count(READ_ONCE(i) % (max + 16), 64, max);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	kunit_info(test, "pcd_clamp_count: %lld ps/call (sum %llu)\n",
+		   ns * 1000 / PCD_TEST_LOOPS, sum);
+
+	sum = 0;
+	start = ktime_get();
+	for (i = 0; i < PCD_TEST_LOOPS; i++)
+		sum += pcd_seek_pos(max, -(READ_ONCE(i) % (max + 16)), max);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	kunit_info(test, "pcd_seek_pos: %lld ps/call (sum %llu)\n",
+		   ns * 1000 / PCD_TEST_LOOPS, sum);
+}
+
+/* Ids out of the way of the static, bench and configfs devices */
+#define PCD_TEST_DEV_ID 4000
+#define PCD_TEST_DEV_SIZE (2 * SZ_1M)
+
+static struct pcdev_platform_data pcd_test_pdata[] = {
+	[0] = {.size = PCD_TEST_DEV_SIZE, .perm = RDWR,
+	       .serial_number = "PCDEVTEST1"},
+	[1] = {.size = PCD_TEST_SIZE, .perm = RDONLY,
+	       .serial_number = "PCDEVTEST2"},
+};
+
+struct pcd_test_dev {
+	struct platform_device *pdev[ARRAY_SIZE(pcd_test_pdata)];
+	/* the read-write device, opened for reading and writing */
+	struct file *filp;
+	char *buf;
+};
+
+static struct file *pcd_test_open(int nth, int flags)
+{
+	char path[32];
+
+	snprintf(path, sizeof(path), "/dev/pcdev-%d", PCD_TEST_DEV_ID + nth);
+	return filp_open(path, flags, 0);
+}
+
+static int pcd_test_dev_init(struct kunit *test)
+{
+	struct pcd_test_dev *td;
+	struct platform_device *pdev;
+	int ret;
+	int i;
+
+	td = kunit_kzalloc(test, sizeof(*td), GFP_KERNEL);
+	if (!td)
+		return -ENOMEM;
+	test->priv = td;
+
+	for (i = 0; i < ARRAY_SIZE(pcd_test_pdata); i++) {
+		pdev = platform_device_register_data(NULL, "pcdev-A1x",
+				PCD_TEST_DEV_ID + i, &pcd_test_pdata[i],
+				sizeof(pcd_test_pdata[i]));
+		if (IS_ERR(pdev))
+			return PTR_ERR(pdev);
+		td->pdev[i] = pdev;
+	}
+
+	/* the driver probes asynchronously */
+	wait_for_device_probe();
+	if (!READ_ONCE(td->pdev[0]->dev.driver)) {
+		kunit_err(test, "pcd_platform_driver did not take the device\n");
+		return -ENODEV;
+	}
+
+	td->filp = pcd_test_open(0, O_RDWR);
+	if (IS_ERR(td->filp)) {
+		ret = PTR_ERR(td->filp);
+		td->filp = NULL;
+		return ret;
+	}
+
+	td->buf = kvmalloc(SZ_1M, GFP_KERNEL);
+	if (!td->buf)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void pcd_test_dev_exit(struct kunit *test)
+{
+	struct pcd_test_dev *td = test->priv;
+	int i;
+
+	if (!td)
+		return;
+
+	kvfree(td->buf);
+	if (td->filp)
+		filp_close(td->filp, NULL);
+	/* files still open keep working on the storage, see the driver */
+	for (i = 0; i < ARRAY_SIZE(td->pdev); i++)
+		if (td->pdev[i])
+			platform_device_unregister(td->pdev[i]);
+}
+
+static void pcd_test_read_write(struct kunit *test)
+{
+	struct pcd_test_dev *td = test->priv;
+	const loff_t max = PCD_TEST_DEV_SIZE;
+	char out[16];
+	char in[16];
+	loff_t pos;
+
+	memset(out, 0xa5, sizeof(out));
+
+	/* a hole reads as zeros */
+	pos = 0;
+	KUNIT_EXPECT_EQ(test, kernel_read(td->filp, in, sizeof(in), &pos),
+			(ssize_t)sizeof(in));
+	KUNIT_EXPECT_TRUE(test, !memchr_inv(in, 0, sizeof(in)));
+
+	/* what is written reads back, across a page boundary */
+	pos = PAGE_SIZE - 8;
+	KUNIT_EXPECT_EQ(test, kernel_write(td->filp, out, sizeof(out), &pos),
+			(ssize_t)sizeof(out));
+	KUNIT_EXPECT_EQ(test, pos, (loff_t)PAGE_SIZE + 8);
+	pos = PAGE_SIZE - 8;
+	KUNIT_EXPECT_EQ(test, kernel_read(td->filp, in, sizeof(in), &pos),
+			(ssize_t)sizeof(in));
+	KUNIT_EXPECT_EQ(test, memcmp(in, out, sizeof(in)), 0);
+
+	/* the last byte, and nothing past it */
+	pos = max - 1;
+	KUNIT_EXPECT_EQ(test, kernel_write(td->filp, out, sizeof(out), &pos),
+			(ssize_t)1);
+	pos = max;
+	KUNIT_EXPECT_EQ(test, kernel_write(td->filp, out, sizeof(out), &pos),
+			(ssize_t)-ENOMEM);
+	pos = max;
+	KUNIT_EXPECT_EQ(test, kernel_read(td->filp, in, sizeof(in), &pos),
+			(ssize_t)0);
+	pos = max - 1;
+	memset(in, 0, sizeof(in));
+	KUNIT_EXPECT_EQ(test, kernel_read(td->filp, in, sizeof(in), &pos),
+			(ssize_t)1);
+	KUNIT_EXPECT_EQ(test, in[0], out[0]);
+}
+
+static void pcd_test_lseek(struct kunit *test)
+{
+	struct pcd_test_dev *td = test->priv;
+	const loff_t max = PCD_TEST_DEV_SIZE;
+	struct file *filp = td->filp;
+
+	KUNIT_EXPECT_EQ(test, vfs_llseek(filp, 0, SEEK_END), max);
+	KUNIT_EXPECT_EQ(test, vfs_llseek(filp, 1, SEEK_END), (loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, vfs_llseek(filp, -max, SEEK_END), (loff_t)0);
+	KUNIT_EXPECT_EQ(test, vfs_llseek(filp, -1, SEEK_CUR), (loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, vfs_llseek(filp, max - 1, SEEK_SET), max - 1);
+	KUNIT_EXPECT_EQ(test, vfs_llseek(filp, 1, SEEK_CUR), max);
+	KUNIT_EXPECT_EQ(test, vfs_llseek(filp, LLONG_MAX, SEEK_CUR),
+			(loff_t)-EINVAL);
+
+	/* a failed seek leaves the position alone */
+	KUNIT_EXPECT_EQ(test, filp->f_pos, max);
+}
+
+/* open() goes through check_permission() with the mode of the file */
+static void pcd_test_open_permission(struct kunit *test)
+{
+	struct file *filp;
+
+	filp = pcd_test_open(1, O_RDWR);
+	KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(filp), -EPERM);
+	if (!IS_ERR(filp))
+		filp_close(filp, NULL);
+
+	filp = pcd_test_open(1, O_WRONLY);
+	KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(filp), -EPERM);
+	if (!IS_ERR(filp))
+		filp_close(filp, NULL);
+
+	filp = pcd_test_open(1, O_RDONLY);
+	KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(filp), 0);
+	if (!IS_ERR(filp))
+		filp_close(filp, NULL);
+}
+
+/*
+ * Microbenchmark of the copy loops of read() and write() at several
+ * sizes, each run long enough to move about PCD_TEST_BENCH_BYTES. Like
+ * pcd_test_bench() it only reports, it fails only if a transfer does.
+ */
+#define PCD_TEST_BENCH_BYTES (64 * SZ_1M)
+
+static const size_t pcd_test_bench_sizes[] = { 64, SZ_4K, SZ_1M };
+
+static s64 pcd_test_time(struct kunit *test, bool write, size_t size,
+			 unsigned int loops)
+{
+	struct pcd_test_dev *td = test->priv;
+	ktime_t start;
+	unsigned int i;
+	ssize_t ret;
+	loff_t pos;
+
+	start = ktime_get();
+	for (i = 0; i < loops; i++) {
+		pos = 0;
+		if (write)
+			ret = kernel_write(td->filp, td->buf, size, &pos);
+		else
+			ret = kernel_read(td->filp, td->buf, size, &pos);
+		if (ret != size) {
+			KUNIT_FAIL(test, "%s of %zu bytes returned %zd\n",
+				   write ? "write" : "read", size, ret);
+			break;
+		}
+	}
+
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static void pcd_test_bench_rw(struct kunit *test)
+{
+	struct pcd_test_dev *td = test->priv;
+	unsigned int loops;
+	size_t size;
+	s64 ns;
+	int i;
+
+	memset(td->buf, 0x5a, SZ_1M);
+
+	for (i = 0; i < ARRAY_SIZE(pcd_test_bench_sizes); i++) {
+		size = pcd_test_bench_sizes[i];
+		loops = clamp_t(size_t, PCD_TEST_BENCH_BYTES / size, 16, 100000);
+
+		/* the first write also fills the holes */
+		ns = pcd_test_time(test, true, size, loops);
+		kunit_info(test, "write %7zu bytes: %lld ns/call, %lld MB/s\n",
+			   size, div_s64(ns, loops),
+			   ns ? div64_s64((s64)size * loops * 1000, ns) : 0);
+
+		ns = pcd_test_time(test, false, size, loops);
+		kunit_info(test, "read  %7zu bytes: %lld ns/call, %lld MB/s\n",
+			   size, div_s64(ns, loops),
+			   ns ? div64_s64((s64)size * loops * 1000, ns) : 0);
+	}
+}
+
+static struct kunit_case pcd_test_dev_cases[] = {
+	KUNIT_CASE(pcd_test_read_write),
+	KUNIT_CASE(pcd_test_lseek),
+	KUNIT_CASE(pcd_test_open_permission),
+	KUNIT_CASE(pcd_test_bench_rw),
+	{}
+};
+
+static struct kunit_suite pcd_test_dev_suite = {
+	.name = "pcd_dev",
+	.init = pcd_test_dev_init,
+	.exit = pcd_test_dev_exit,
+	.test_cases = pcd_test_dev_cases,
+};
+
+static struct kunit_case pcd_test_cases[] = {
+	KUNIT_CASE(pcd_test_clamp_count),
+	KUNIT_CASE(pcd_test_seek_pos),
+	KUNIT_CASE(pcd_test_permission),
+	KUNIT_CASE(pcd_test_bench),
+	{}
+};
+
+static struct kunit_suite pcd_test_suite = {
+	.name = "pcd",
+	.test_cases = pcd_test_cases,
+};
+kunit_test_suites(&pcd_test_suite, &pcd_test_dev_suite);
+
+/* the device tests need the driver */
+MODULE_SOFTDEP("pre: pcd_platform_driver");
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("KUnit tests of the pcd platform driver");
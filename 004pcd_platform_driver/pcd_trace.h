@@ -0,0 +1,133 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pcd
+
+#if !defined(_PCD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PCD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints of the pcd platform driver. They are compiled in but patched
+ * out (static keys) until enabled, e.g.:
+ *	echo 1 > /sys/kernel/tracing/events/pcd/enable
+ */
+
+TRACE_EVENT(pcd_open,
+	TP_PROTO(int id, int minor, fmode_t mode, int ret),
+	TP_ARGS(id, minor, mode, ret),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(int, minor)
+		__field(unsigned int, mode)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->minor = minor;
+		__entry->mode = (__force unsigned int)mode;
+		__entry->ret = ret;
+	),
+
+	TP_printk("pcdev-%d minor=%d mode=0x%x ret=%d",
+		  __entry->id, __entry->minor, __entry->mode, __entry->ret)
+);
+
+TRACE_EVENT(pcd_release,
+	TP_PROTO(int id),
+	TP_ARGS(id),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+	),
+
+	TP_printk("pcdev-%d", __entry->id)
+);
+
+DECLARE_EVENT_CLASS(pcd_rw_class,
+	TP_PROTO(int id, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(id, pos, count, ret),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+
+	TP_printk("pcdev-%d pos=%lld count=%zu ret=%zd",
+		  __entry->id, __entry->pos, __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(pcd_rw_class, pcd_read,
+	TP_PROTO(int id, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(id, pos, count, ret)
+);
+
+DEFINE_EVENT(pcd_rw_class, pcd_write,
+	TP_PROTO(int id, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(id, pos, count, ret)
+);
+
+TRACE_EVENT(pcd_lseek,
+	TP_PROTO(int id, loff_t off, int whence, loff_t ret),
+	TP_ARGS(id, off, whence, ret),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(loff_t, off)
+		__field(int, whence)
+		__field(loff_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->off = off;
+		__entry->whence = whence;
+		__entry->ret = ret;
+	),
+
+	TP_printk("pcdev-%d off=%lld whence=%d ret=%lld",
+		  __entry->id, __entry->off, __entry->whence, __entry->ret)
+);
+
+/* Time spent in each step of a probe, 'total' covering the whole probe */
+TRACE_EVENT(pcd_probe_step,
+	TP_PROTO(int id, const char *step, u64 ns),
+	TP_ARGS(id, step, ns),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__string(step, step)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__assign_str(step, step);
+		__entry->ns = ns;
+	),
+
+	TP_printk("pcdev-%d step=%s ns=%llu",
+		  __entry->id, __get_str(step), __entry->ns)
+);
+
+#endif /* _PCD_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE pcd_trace
+#include <trace/define_trace.h>
@@ -1,10 +1,36 @@
 struct pcdev_platform_data {
-	int size;
+	loff_t size;
 	int perm;
 	const char * serial_number;
+	int mode;
+	int numa_node;
+	int numa_policy;
+	/* optional file a flat device is loaded from and written back to */
+	const char * backing_file;
+	/* what memory pressure may take from a flat device while it is idle */
+	int reclaim;
 };
 
+/* Name of the platform driver of all the pcdevs */
+#define PCD_DRIVER_NAME "pseudo-char-device"
+
 /* Permission codes */
 #define RDWR 0x11
 #define RDONLY 0x01
 #define WRONLY 0x10
+
+/* Device modes */
+#define PCD_MODE_FLAT 0x00 /* fixed size buffer addressed by f_pos */
+#define PCD_MODE_SPSC 0x01 /* lock-free single producer/consumer ring */
+#define PCD_MODE_SHARDED 0x02 /* per-CPU record shards, read merged */
+#define PCD_MODE_RECORD 0x03 /* stamped records on the kernel ring_buffer */
+
+/* NUMA placement of the device pages */
+#define PCD_NUMA_DEFAULT    0x00 /* node of the platform device, if any */
+#define PCD_NUMA_PREFERRED  0x01 /* 'numa_node', falling back to others */
+#define PCD_NUMA_INTERLEAVE 0x02 /* round robin over the online nodes */
+
+/* Reclaim of the pages of idle flat devices */
+#define PCD_RECLAIM_NONE    0x00 /* pages stay until the device is removed */
+#define PCD_RECLAIM_CLEAN   0x01 /* pages already in the backing file */
+#define PCD_RECLAIM_DISCARD 0x02 /* any page and the snapshot, lost for good */